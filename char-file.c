@@ -0,0 +1,332 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "log.h"
+#include "utils.h"
+#include "char.h"
+
+/* Atomic update, changes go to a copy renamed over the file on close */
+struct file_priv {
+	char *name;
+	char *tmp;
+};
+
+/* Copies the file contents, sharing extents (reflink) when supported */
+static int file_copy(int src, int dst, size_t size)
+{
+	char buf[65536];
+	off_t off = 0;
+	ssize_t ret;
+
+	if (!ioctl(dst, FICLONE, src))
+		return 0;
+
+	ldebug("Reflink not supported (%s), copying", strerror(errno));
+	while (off < size) {
+		ret = copy_file_range(src, &off, dst, NULL, size - off, 0);
+		if (ret > 0)
+			continue;
+		if (ret < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL)
+			return -1;
+		break;
+	}
+
+	/* Plain copy where the kernel cannot copy between the files */
+	while (off < size) {
+		ret = pread(src, buf, sizeof(buf), off);
+		if (ret <= 0 || pwrite(dst, buf, ret, off) != ret)
+			return -1;
+		off += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Opens a copy of the file created next to it, a crash before the rename
+ * on close leaves the file intact. Missing file starts as an empty copy.
+ */
+static int file_copy_open(const char *file_name, struct file_priv *fp)
+{
+	struct stat fs;
+	mode_t mask;
+	int fd, src;
+
+	if (asprintf(&fp->tmp, "%s.XXXXXX", file_name) < 0) {
+		fp->tmp = NULL;
+		perror("asprintf() failed");
+		return -1;
+	}
+
+	fd = mkstemp(fp->tmp);
+	if (fd == -1) {
+		perror("mkstemp() failed");
+		free(fp->tmp);
+		fp->tmp = NULL;
+		return -1;
+	}
+
+	src = open(file_name, O_RDONLY);
+	if (src == -1 && errno != ENOENT) {
+		perror("open() failed");
+		goto fail;
+	}
+
+	if (src == -1) {
+		mask = umask(0);
+		umask(mask);
+		fchmod(fd, 0644 & ~mask);
+		return fd;
+	}
+
+	if (fstat(src, &fs)) {
+		perror("fstat() failed");
+		goto fail;
+	}
+
+	if (!S_ISREG(fs.st_mode)) {
+		lerror("Atomic update requires a regular file");
+		goto fail;
+	}
+
+	/* Other names of the file would keep the old contents */
+	if (fs.st_nlink > 1) {
+		lerror("Atomic update would break %lu hard links of the file",
+		       (unsigned long)fs.st_nlink);
+		goto fail;
+	}
+
+	if (fchown(fd, fs.st_uid, fs.st_gid)) {
+		perror("Failed to keep storage file owner");
+		goto fail;
+	}
+	fchmod(fd, fs.st_mode & 07777);
+	if (file_copy(src, fd, fs.st_size)) {
+		perror("Failed to copy storage file");
+		goto fail;
+	}
+
+	close(src);
+	return fd;
+fail:
+	if (src != -1)
+		close(src);
+	close(fd);
+	unlink(fp->tmp);
+	free(fp->tmp);
+	fp->tmp = NULL;
+	return -1;
+}
+
+/*
+ * Regular file or a device node without erase blocks. Read-only files
+ * keep their size and are not created.
+ */
+static ssize_t file_open(struct storage_device *dev, const char *file_name,
+			 size_t pref_size, const char *opts)
+{
+	struct file_priv *fp = NULL;
+	struct stat fs;
+	const char *val;
+	int fd = -1;
+	int file_init = 0;
+	size_t file_size;
+
+	if (!file_name) {
+		lerror("Storage file not specified");
+		return -1;
+	}
+
+	if (dev->flags & STORAGE_RDONLY) {
+		fd = open(file_name, O_RDONLY);
+		if (fd == -1)
+			perror("open() failed");
+	} else if (sopt_find(opts, "atomic")) {
+		fp = calloc(1, sizeof(*fp));
+		if (!fp) {
+			perror("calloc() failed");
+			return -1;
+		}
+		/* Symbolic links are kept, the file they lead to is replaced */
+		fp->name = realpath(file_name, NULL);
+		if (!fp->name && errno == ENOENT && lstat(file_name, &fs))
+			fp->name = strdup(file_name);
+		if (fp->name)
+			fd = file_copy_open(fp->name, fp);
+		else
+			perror("Failed to resolve storage file");
+	} else {
+		file_init = access(file_name, F_OK);
+		fd = open(file_name, O_CREAT|O_RDWR, 0644);
+		if (fd == -1)
+			perror("open() failed");
+	}
+	if (fd == -1)
+		goto fail;
+
+	if (fstat(fd, &fs)) {
+		perror("fstat() failed");
+		goto fail;
+	}
+
+	file_size = fs.st_size;
+	if (pref_size && !(dev->flags & STORAGE_RDONLY)) {
+		if (ftruncate(fd, pref_size))
+			perror("ftruncate() failed");
+		else
+			file_size = pref_size;
+	}
+
+	if (!file_size) {
+		fprintf(stderr, "Invalid storage size\n");
+		goto fail;
+	}
+
+	/* EEPROM page size, writes are split and coalesced to pages */
+	val = sopt_find(opts, "wpage");
+	if (val && *val)
+		dev->write_size = strtoul(val, NULL, 0);
+
+	dev->fd = fd;
+	dev->priv = fp;
+	dev->size = file_size;
+
+	return fs.st_size < file_size ? fs.st_size : file_size;
+fail:
+	if (fd != -1)
+		close(fd);
+	if (file_init)
+		unlink(file_name);
+	if (fp) {
+		if (fp->tmp) {
+			unlink(fp->tmp);
+			free(fp->tmp);
+		}
+		free(fp->name);
+		free(fp);
+	}
+	return -1;
+}
+
+/* Commits an atomic update, the copy is synced before as set by the sync mode */
+static void file_commit(struct storage_device *dev, struct file_priv *fp)
+{
+	char *dir;
+	int fd;
+
+	if (rename(fp->tmp, fp->name)) {
+		perror("rename() failed");
+		unlink(fp->tmp);
+		return;
+	}
+
+	if (dev->sync != STORAGE_SYNC_FULL)
+		return;
+
+	/* Makes the rename durable */
+	dir = strdup(fp->name);
+	fd = open(dirname(dir), O_RDONLY|O_DIRECTORY);
+	if (fd != -1) {
+		fsync(fd);
+		close(fd);
+	}
+	free(dir);
+}
+
+static void file_close(struct storage_device *dev)
+{
+	struct file_priv *fp = dev->priv;
+
+	close(dev->fd);
+
+	if (!fp)
+		return;
+
+	if (dev->flags & STORAGE_DISCARD)
+		unlink(fp->tmp);
+	else
+		file_commit(dev, fp);
+	free(fp->tmp);
+	free(fp->name);
+	free(fp);
+}
+
+/* Read-only mapping is private, changes made by the models stay in memory */
+static void *file_map(struct storage_device *dev)
+{
+	void *base;
+
+	base = mmap(NULL, dev->size, PROT_READ|PROT_WRITE,
+		    dev->flags & STORAGE_RDONLY ? MAP_PRIVATE : MAP_SHARED, dev->fd, 0);
+	if (base == MAP_FAILED) {
+		perror("mmap() failed");
+		return NULL;
+	}
+
+	return base;
+}
+
+static void file_unmap(struct storage_device *dev)
+{
+	if (munmap(dev->base, dev->size))
+		perror("munmap() failed");
+}
+
+static ssize_t file_read(struct storage_device *dev, void *buf, size_t len, off_t off)
+{
+	return pread(dev->fd, buf, len, off);
+}
+
+static ssize_t file_write(struct storage_device *dev, const void *buf, size_t len, off_t off)
+{
+	return pwrite(dev->fd, buf, len, off);
+}
+
+/* Written data only is the range of dirty pages of the mapping */
+static int file_sync(struct storage_device *dev)
+{
+	if (dev->sync == STORAGE_SYNC_RANGE)
+		return dev->cache ? fdatasync(dev->fd) : msync(dev->base, dev->size, MS_SYNC);
+
+	return fsync(dev->fd);
+}
+
+/* Whole file mapped shared */
+static struct storage_backend mmap_backend = {
+	.name = "mmap",
+	.def = 1,
+	.open = file_open,
+	.close = file_close,
+	.map = file_map,
+	.unmap = file_unmap,
+	.read = file_read,
+	.write = file_write,
+	.sync = file_sync,
+};
+
+/* Pages read with pread on access, written back with pwrite */
+static struct storage_backend file_backend = {
+	.name = "file",
+	.open = file_open,
+	.close = file_close,
+	.read = file_read,
+	.write = file_write,
+	.sync = file_sync,
+};
+
+static void __attribute__((constructor)) file_register(void)
+{
+	storage_register(&mmap_backend);
+	storage_register(&file_backend);
+}
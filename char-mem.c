@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "log.h"
+#include "char.h"
+
+/*
+ * Anonymous memory of the preferred size, starts empty and is dropped
+ * on close. Runs the data models without any file I/O.
+ */
+static ssize_t mem_open(struct storage_device *dev, const char *file_name,
+			size_t pref_size, const char *opts)
+{
+	void *mem;
+
+	if (!pref_size) {
+		lerror("Memory storage requires size");
+		return -1;
+	}
+
+	mem = mmap(NULL, pref_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap() failed");
+		return -1;
+	}
+
+	dev->priv = mem;
+	dev->size = pref_size;
+
+	return 0;
+}
+
+static void mem_close(struct storage_device *dev)
+{
+	if (munmap(dev->priv, dev->size))
+		perror("munmap() failed");
+}
+
+static void *mem_map(struct storage_device *dev)
+{
+	return dev->priv;
+}
+
+static void mem_unmap(struct storage_device *dev)
+{
+}
+
+static ssize_t mem_read(struct storage_device *dev, void *buf, size_t len, off_t off)
+{
+	memcpy(buf, dev->priv + off, len);
+	return len;
+}
+
+static ssize_t mem_write(struct storage_device *dev, const void *buf, size_t len, off_t off)
+{
+	memcpy(dev->priv + off, buf, len);
+	return len;
+}
+
+static int mem_sync(struct storage_device *dev)
+{
+	return 0;
+}
+
+static struct storage_backend mem_backend = {
+	.name = "mem",
+	.open = mem_open,
+	.close = mem_close,
+	.map = mem_map,
+	.unmap = mem_unmap,
+	.read = mem_read,
+	.write = mem_write,
+	.sync = mem_sync,
+};
+
+static void __attribute__((constructor)) mem_register(void)
+{
+	storage_register(&mem_backend);
+}
@@ -0,0 +1,174 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <mtd/mtd-user.h>
+
+#include "log.h"
+#include "utils.h"
+#include "char.h"
+
+#define MTD_ERASE_DEFAULT 4096
+
+struct mtd_priv {
+	/* Regular file image, erase is emulated by writing empty blocks */
+	int image;
+	void *blank;
+};
+
+static ssize_t mtd_open(struct storage_device *dev, const char *file_name,
+			size_t pref_size, const char *opts)
+{
+	struct mtd_info_user info;
+	struct mtd_priv *mp;
+	struct stat fs;
+	const char *val;
+	int fd = -1;
+	int file_init = 0;
+	size_t file_size;
+
+	if (!file_name) {
+		lerror("Storage file not specified");
+		return -1;
+	}
+
+	mp = calloc(1, sizeof(*mp));
+	if (!mp) {
+		perror("calloc() failed");
+		return -1;
+	}
+
+	if (dev->flags & STORAGE_RDONLY) {
+		fd = open(file_name, O_RDONLY);
+	} else {
+		file_init = access(file_name, F_OK);
+		fd = open(file_name, O_CREAT|O_RDWR, 0644);
+	}
+	if (fd == -1) {
+		perror("open() failed");
+		goto fail;
+	}
+
+	if (!ioctl(fd, MEMGETINFO, &info)) {
+		if (pref_size && pref_size != info.size)
+			ldebug("Ignoring preferred size of MTD device %u", info.size);
+		dev->fd = fd;
+		dev->priv = mp;
+		dev->size = info.size;
+		dev->erase_size = info.erasesize;
+		dev->write_size = info.writesize;
+		return dev->size;
+	}
+
+	if (fstat(fd, &fs)) {
+		perror("fstat() failed");
+		goto fail;
+	}
+
+	file_size = fs.st_size;
+	if (pref_size && !(dev->flags & STORAGE_RDONLY)) {
+		if (ftruncate(fd, pref_size))
+			perror("ftruncate() failed");
+		else
+			file_size = pref_size;
+	}
+
+	val = sopt_find(opts, "erase");
+	dev->erase_size = val && *val ? strtoul(val, NULL, 0) : MTD_ERASE_DEFAULT;
+	dev->write_size = 1;
+	if (!file_size || !dev->erase_size || file_size % dev->erase_size) {
+		lerror("Invalid storage size %zu for erase size %zu", file_size, dev->erase_size);
+		goto fail;
+	}
+
+	mp->image = 1;
+	mp->blank = malloc(dev->erase_size);
+	if (!mp->blank) {
+		perror("malloc() failed");
+		goto fail;
+	}
+	memset(mp->blank, 0xFF, dev->erase_size);
+
+	dev->fd = fd;
+	dev->priv = mp;
+	dev->size = file_size;
+
+	return fs.st_size < file_size ? fs.st_size : file_size;
+fail:
+	free(mp);
+	if (fd != -1)
+		close(fd);
+	if (file_init)
+		unlink(file_name);
+	return -1;
+}
+
+static void mtd_close(struct storage_device *dev)
+{
+	struct mtd_priv *mp = dev->priv;
+
+	free(mp->blank);
+	free(mp);
+	close(dev->fd);
+}
+
+static ssize_t mtd_read(struct storage_device *dev, void *buf, size_t len, off_t off)
+{
+	return pread(dev->fd, buf, len, off);
+}
+
+static ssize_t mtd_write(struct storage_device *dev, const void *buf, size_t len, off_t off)
+{
+	return pwrite(dev->fd, buf, len, off);
+}
+
+static int mtd_erase(struct storage_device *dev, off_t off, size_t len)
+{
+	struct mtd_priv *mp = dev->priv;
+	struct erase_info_user ei;
+	size_t done;
+
+	if (!mp->image) {
+		ei.start = off;
+		ei.length = len;
+		return ioctl(dev->fd, MEMERASE, &ei);
+	}
+
+	for (done = 0; done < len; done += dev->erase_size) {
+		if (pwrite(dev->fd, mp->blank, dev->erase_size, off + done) != dev->erase_size)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Writes to the device are synchronous */
+static int mtd_sync(struct storage_device *dev)
+{
+	struct mtd_priv *mp = dev->priv;
+
+	if (!mp->image)
+		return 0;
+
+	return dev->sync == STORAGE_SYNC_RANGE ? fdatasync(dev->fd) : fsync(dev->fd);
+}
+
+/* Erase block device, changed blocks are erased and written whole */
+static struct storage_backend mtd_backend = {
+	.name = "mtd",
+	.open = mtd_open,
+	.close = mtd_close,
+	.read = mtd_read,
+	.write = mtd_write,
+	.erase = mtd_erase,
+	.sync = mtd_sync,
+};
+
+static void __attribute__((constructor)) mtd_register(void)
+{
+	storage_register(&mtd_backend);
+}
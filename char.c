@@ -1,83 +1,546 @@
-
-#include <fcntl.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
-#include <sys/stat.h>
 #include <sys/types.h>
 
 #include "log.h"
+#include "utils.h"
 #include "char.h"
 
-void storage_close(struct storage_device *dev)
+#define PAGE_ABSENT 0
+#define PAGE_CLEAN 1
+
+#define PAGED_PAGE_DEFAULT 256
+#define PAGED_AHEAD_DEFAULT 4
+
+#define STORAGE_BACKENDS_MAX 8
+
+static struct storage_backend *backends[STORAGE_BACKENDS_MAX];
+static int backends_cnt;
+
+/* Accounts a transfer and sleeps for its emulated duration */
+static void storage_delay(struct storage_cache *sc, size_t len, unsigned long extra_ns)
 {
-	fsync(dev->fd);
-	if (munmap(dev->base, dev->size))
-		perror("munmap() failed");
-	close(dev->fd);
+	unsigned long long ns;
+	struct timespec ts;
+
+	ns = sc->xfer_ns + (unsigned long long)sc->byte_ns * len + extra_ns;
+	if (!ns)
+		return;
+
+	sc->stats.delay_ns += ns;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
 }
 
-struct storage_device *storage_open(const char *file_name, int pref_size)
+/* Reads count pages starting at first in a single transfer */
+static int storage_read_pages(struct storage_device *dev, size_t first, size_t count)
 {
-	struct storage_device *dev;
-	struct stat fs;
-	int fd = -1;
-	int file_init, file_size, last_size;
+	struct storage_cache *sc = dev->cache;
+	void *addr = dev->base + first * sc->page;
+	size_t off = first * sc->page;
+	size_t len = count * sc->page;
+	size_t done = 0;
+	ssize_t ret;
 
-	ldebug("Opening storage memory file %s, preferred size: %d", file_name, pref_size);
+	if (off + len > dev->size)
+		len = dev->size - off;
 
-	dev = malloc(sizeof(*dev));
-	if (!dev) {
+	while (done < len) {
+		ret = dev->ops->read(dev, addr + done, len - done, off + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		/* Short file reads as zeroes, same as the mapping */
+		if (!ret) {
+			memset(addr + done, 0, len - done);
+			break;
+		}
+		done += ret;
+	}
+
+	sc->stats.reads++;
+	sc->stats.bytes_read += len;
+	storage_delay(sc, len, 0);
+
+	memcpy(sc->orig + off, addr, len);
+	memset(sc->state + first, PAGE_CLEAN, count);
+
+	return 0;
+}
+
+/*
+ * Reads absent pages of the range before the caller uses it. A read
+ * starting at the page following the previous one doubles the read ahead
+ * window, so walking the record chain costs few transfers, a read
+ * elsewhere drops the window. Mapped storage is always readable.
+ */
+int storage_fetch(struct storage_device *dev, size_t off, size_t len)
+{
+	struct storage_cache *sc = dev->cache;
+	size_t i, j, last, ahead;
+
+	if (!sc || !len)
+		return 0;
+	if (off >= dev->size || len > dev->size - off)
+		return -1;
+
+	last = (off + len - 1) / sc->page;
+	for (i = off / sc->page; i <= last; i = j) {
+		j = i + 1;
+		if (sc->state[i] != PAGE_ABSENT)
+			continue;
+		while (j <= last && sc->state[j] == PAGE_ABSENT)
+			j++;
+
+		if (i == sc->next)
+			sc->window = sc->window ? sc->window * 2 : 1;
+		else
+			sc->window = 0;
+		if (sc->window > sc->ahead)
+			sc->window = sc->ahead;
+
+		for (ahead = 0; ahead < sc->window && j < sc->pages; ahead++, j++) {
+			if (sc->state[j] != PAGE_ABSENT)
+				break;
+		}
+		sc->next = j;
+
+		if (storage_read_pages(dev, i, j - i)) {
+			perror("Failed to read storage pages");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* storage_fetch() by address, addresses out of the storage are not paged */
+int storage_fetch_addr(void *arg, const void *addr, size_t len)
+{
+	struct storage_device *dev = arg;
+
+	if (addr < dev->base || addr >= dev->base + dev->size)
+		return 0;
+	if (len > dev->base + dev->size - addr)
+		len = dev->base + dev->size - addr;
+
+	return storage_fetch(dev, addr - dev->base, len);
+}
+
+/*
+ * Reads the range ahead of use when the caller knows it is needed, absent
+ * pages are read in one transfer per run regardless of the window.
+ */
+void storage_readahead(struct storage_device *dev, size_t off, size_t len)
+{
+	struct storage_cache *sc = dev->cache;
+	size_t i, j, last;
+
+	if (!len || off >= dev->size)
+		return;
+	if (off + len > dev->size)
+		len = dev->size - off;
+
+	if (!sc) {
+		last = off & ~(sysconf(_SC_PAGESIZE) - 1);
+		madvise(dev->base + last, off + len - last, MADV_WILLNEED);
+		return;
+	}
+
+	last = (off + len - 1) / sc->page;
+	for (i = off / sc->page; i <= last; i = j) {
+		j = i + 1;
+		if (sc->state[i] != PAGE_ABSENT)
+			continue;
+		while (j <= last && sc->state[j] == PAGE_ABSENT)
+			j++;
+		if (storage_read_pages(dev, i, j - i))
+			perror("Failed to read storage pages");
+	}
+}
+
+/* Writes the range in one transfer, a write cycle of page write devices */
+static int storage_write(struct storage_device *dev, size_t off, size_t len)
+{
+	struct storage_cache *sc = dev->cache;
+	size_t done;
+	ssize_t ret;
+
+	for (done = 0; done < len; done += ret) {
+		ret = dev->ops->write(dev, dev->base + off + done, len - done, off + done);
+		if (ret < 0 && errno == EINTR) {
+			ret = 0;
+			continue;
+		}
+		if (ret <= 0) {
+			perror("Failed to write storage");
+			return -1;
+		}
+	}
+
+	sc->stats.writes++;
+	sc->stats.bytes_written += len;
+	storage_delay(sc, len, sc->wcycle_ns);
+	memcpy(sc->orig + off, dev->base + off, len);
+
+	return 0;
+}
+
+/* Read page differing from its contents as read, absent pages never change */
+static int storage_page_changed(struct storage_device *dev, size_t page)
+{
+	struct storage_cache *sc = dev->cache;
+	size_t off = page * sc->page;
+	size_t len = off + sc->page > dev->size ? dev->size - off : sc->page;
+
+	if (sc->state[page] == PAGE_ABSENT)
+		return 0;
+	if (memcmp(dev->base + off, sc->orig + off, len))
+		return 1;
+
+	sc->stats.write_skip++;
+	return 0;
+}
+
+/* Erases runs of changed pages and writes them whole */
+static int storage_writeback_erase(struct storage_device *dev)
+{
+	struct storage_cache *sc = dev->cache;
+	size_t i, j, off, len;
+	int fail = 0;
+
+	for (i = 0; i < sc->pages; i = j) {
+		j = i + 1;
+		if (!storage_page_changed(dev, i))
+			continue;
+		while (j < sc->pages && storage_page_changed(dev, j))
+			j++;
+
+		off = i * sc->page;
+		len = (j - i) * sc->page;
+		if (off + len > dev->size)
+			len = dev->size - off;
+
+		/* Pages are whole erase blocks */
+		if (dev->ops->erase(dev, off, len)) {
+			perror("Failed to erase storage");
+			fail = 1;
+			continue;
+		}
+		sc->stats.erases++;
+
+		if (storage_write(dev, off, len))
+			fail = 1;
+	}
+
+	return fail;
+}
+
+/*
+ * Writes back changes found by comparing read pages with their contents
+ * as read, unchanged pages are skipped. Devices of a write page size take
+ * a write cycle per changed device page, only the changed span of it is
+ * written. Other devices get changed pages merged into runs.
+ */
+static int storage_writeback(struct storage_device *dev)
+{
+	struct storage_cache *sc = dev->cache;
+	size_t unit = dev->write_size ? dev->write_size : sc->page;
+	size_t i, off, end, len, first, last;
+	size_t run = 0, run_len = 0;
+	int fail = 0;
+
+	if (dev->erase_size)
+		return storage_writeback_erase(dev);
+
+	for (i = 0; i < sc->pages; i++) {
+		if (sc->state[i] == PAGE_ABSENT)
+			continue;
+
+		end = (i + 1) * sc->page;
+		if (end > dev->size)
+			end = dev->size;
+
+		for (off = i * sc->page; off < end; off += unit) {
+			len = end - off < unit ? end - off : unit;
+			if (!memcmp(dev->base + off, sc->orig + off, len)) {
+				sc->stats.write_skip++;
+				continue;
+			}
+
+			if (!dev->write_size) {
+				if (run_len && run + run_len == off) {
+					run_len += len;
+					continue;
+				}
+				if (run_len && storage_write(dev, run, run_len))
+					fail = 1;
+				run = off;
+				run_len = len;
+				continue;
+			}
+
+			for (first = 0; ((uint8_t *)dev->base)[off + first] == sc->orig[off + first]; first++)
+				;
+			for (last = len - 1; ((uint8_t *)dev->base)[off + last] == sc->orig[off + last]; last--)
+				;
+			if (storage_write(dev, off + first, last - first + 1))
+				fail = 1;
+		}
+	}
+
+	if (run_len && storage_write(dev, run, run_len))
+		fail = 1;
+
+	return fail;
+}
+
+/*
+ * Allocates the page cache of the storage, pages are read by
+ * storage_fetch() before use. Options set the page size and the read
+ * ahead limit and emulate device latency, i2c=<kHz> models a bus of 9
+ * clocks per byte and 4 bytes of addressing per transfer.
+ */
+static void *storage_map_paged(struct storage_device *dev, const char *opts)
+{
+	struct storage_cache *sc;
+	const char *val;
+	void *base;
+
+	sc = calloc(1, sizeof(*sc));
+	if (!sc) {
+		perror("calloc() failed");
+		return NULL;
+	}
+
+	/* Pages are whole erase blocks or whole write pages */
+	sc->page = PAGED_PAGE_DEFAULT;
+	if (dev->erase_size)
+		sc->page = dev->erase_size;
+	else if (dev->write_size > sc->page)
+		sc->page = dev->write_size;
+	val = sopt_find(opts, "page");
+	if (val && *val)
+		sc->page = strtoul(val, NULL, 0);
+	if (!sc->page || (dev->erase_size && sc->page % dev->erase_size)) {
+		lerror("Unsupported page size %zu for erase size %zu", sc->page, dev->erase_size);
+		free(sc);
+		return NULL;
+	}
+	if (dev->write_size && !dev->erase_size && sc->page % dev->write_size) {
+		lerror("Unsupported write page size %zu", dev->write_size);
+		free(sc);
+		return NULL;
+	}
+	sc->pages = (dev->size + sc->page - 1) / sc->page;
+	sc->state = calloc(sc->pages, 1);
+	sc->orig = malloc(sc->pages * sc->page);
+	base = malloc(sc->pages * sc->page);
+	if (!sc->state || !sc->orig || !base) {
 		perror("malloc() failed");
+		free(sc->state);
+		free(sc->orig);
+		free(base);
+		free(sc);
 		return NULL;
 	}
+	/* Access without fetch reads as empty storage */
+	memset(base, 0xFF, sc->pages * sc->page);
 
-	file_init = access(file_name, F_OK);
+	sc->ahead = PAGED_AHEAD_DEFAULT;
+	val = sopt_find(opts, "ahead");
+	if (val && *val)
+		sc->ahead = atoi(val);
 
-	fd = open(file_name, O_CREAT|O_SYNC|O_RDWR, 0644);
-	if (fd == -1) {
-		perror("open() failed");
-		goto fail;
+	val = sopt_find(opts, "i2c");
+	if (val && atoi(val) > 0) {
+		sc->byte_ns = 9 * 1000000UL / atoi(val);
+		sc->xfer_ns = 4 * sc->byte_ns;
+		sc->wcycle_ns = 5000000;
 	}
+	val = sopt_find(opts, "byte_ns");
+	if (val && *val)
+		sc->byte_ns = strtoul(val, NULL, 10);
+	val = sopt_find(opts, "xfer_ns");
+	if (val && *val)
+		sc->xfer_ns = strtoul(val, NULL, 10);
+	val = sopt_find(opts, "wcycle_ns");
+	if (val && *val)
+		sc->wcycle_ns = strtoul(val, NULL, 10);
+	sc->report = !!sopt_find(opts, "stats");
+	sc->next = -1;
+
+	dev->cache = sc;
+	dev->base = base;
+
+	return base;
+}
+
+static void storage_unmap_paged(struct storage_device *dev)
+{
+	struct storage_cache *sc = dev->cache;
+
+	if (sc->report)
+		linfo("Storage device: %lu reads %lu bytes, %lu writes %lu bytes, %lu unchanged, "
+		      "%lu erases, %llu.%03llu ms",
+		      sc->stats.reads, sc->stats.bytes_read,
+		      sc->stats.writes, sc->stats.bytes_written, sc->stats.write_skip,
+		      sc->stats.erases,
+		      sc->stats.delay_ns / 1000000, sc->stats.delay_ns / 1000 % 1000);
 
-	if (fstat(fd, &fs)) {
-		perror("fstat() failed");
-		goto fail;
+	free(dev->base);
+	free(sc->state);
+	free(sc->orig);
+	free(sc);
+	dev->cache = NULL;
+}
+
+/* Keeps the file as it was when updated atomically, in place changes stay */
+void storage_discard(struct storage_device *dev)
+{
+	dev->flags |= STORAGE_DISCARD;
+}
+
+void storage_close(struct storage_device *dev)
+{
+	int rdonly = dev->flags & STORAGE_RDONLY;
+
+	if (dev->cache && !rdonly)
+		storage_writeback(dev);
+
+	if (!rdonly && dev->sync != STORAGE_SYNC_NONE && dev->ops->sync(dev))
+		perror("Failed to sync storage");
+
+	if (dev->cache)
+		storage_unmap_paged(dev);
+	else
+		dev->ops->unmap(dev);
+
+	dev->ops->close(dev);
+	free(dev);
+}
+
+int storage_register(struct storage_backend *ops)
+{
+	if (backends_cnt == STORAGE_BACKENDS_MAX) {
+		lerror("Too many storage backends");
+		return -1;
 	}
 
-	file_size = fs.st_size;
-	if (pref_size) {
-		if (ftruncate(fd, pref_size))
-			perror("ftruncate() failed");
-		else
-			file_size = pref_size;
+	ldebug("Registering storage backend: %s", ops->name);
+	backends[backends_cnt++] = ops;
+
+	return 0;
+}
+
+/* Named backend or the default one when name is NULL */
+static struct storage_backend *storage_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < backends_cnt; i++) {
+		if (name ? !strcmp(backends[i]->name, name) : backends[i]->def)
+			return backends[i];
 	}
 
-	if (!file_size) {
-		fprintf(stderr, "Invalid storage size\n");
-		goto fail;
+	return NULL;
+}
+
+/* Value of a sync=<none|range|full> option */
+static int storage_sync_mode(const char *val)
+{
+	static const char *modes[] = {
+		[STORAGE_SYNC_FULL] = "full",
+		[STORAGE_SYNC_RANGE] = "range",
+		[STORAGE_SYNC_NONE] = "none",
+	};
+	size_t len = strcspn(val, ",");
+	int i;
+
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		if (strlen(modes[i]) == len && !strncmp(val, modes[i], len))
+			return i;
 	}
 
-	dev->fd = fd;
-	dev->size = file_size;
-	dev->base = mmap(NULL, file_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	if (dev->base == MAP_FAILED) {
-		perror("mmap() failed");
-		goto fail;
+	return -1;
+}
+
+/*
+ * Opens the storage through a backend. Backends without direct access
+ * and all of them with the "paged" option are demand paged over read
+ * and write. Read-only storage is never written or synced.
+ */
+struct storage_device *storage_open(const char *backend, const char *file_name,
+				    int pref_size, int flags, const char *opts)
+{
+	struct storage_device *dev;
+	const char *val;
+	ssize_t init;
+	int sync = STORAGE_SYNC_FULL;
+
+	val = sopt_find(opts, "sync");
+	if (val) {
+		sync = storage_sync_mode(val);
+		if (sync < 0) {
+			lerror("Unknown storage sync mode '%s'", val);
+			return NULL;
+		}
 	}
 
-	last_size = fs.st_size;
-	while (last_size < pref_size)
-		((char *)dev->base)[last_size++] = 0xFF;
+	ldebug("Opening storage %s on %s backend, preferred size: %d", file_name,
+	       backend ? backend : "default", pref_size);
 
-	return dev;
-fail:
-	if (dev)
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		perror("calloc() failed");
+		return NULL;
+	}
+	dev->fd = -1;
+	dev->flags = flags;
+	dev->sync = sync;
+
+	/* Storage not created yet reads as empty one of the preferred size */
+	if ((flags & STORAGE_RDONLY) && file_name && pref_size &&
+	    access(file_name, F_OK) && errno == ENOENT) {
+		ldebug("Storage %s does not exist, reading empty memory", file_name);
+		backend = "mem";
+	}
+
+	dev->ops = storage_find(backend);
+	if (!dev->ops) {
+		lerror("Unknown storage backend '%s'", backend);
 		free(dev);
-	if (fd != -1)
-		close(fd);
-	if (file_init)
-		unlink(file_name);
-	return NULL;
+		return NULL;
+	}
+
+	init = dev->ops->open(dev, file_name, pref_size, opts);
+	if (init < 0) {
+		free(dev);
+		return NULL;
+	}
+
+	if (!dev->ops->map || sopt_find(opts, "paged") || dev->write_size)
+		dev->base = storage_map_paged(dev, opts);
+	else
+		dev->base = dev->ops->map(dev);
+	if (!dev->base) {
+		dev->ops->close(dev);
+		free(dev);
+		return NULL;
+	}
+
+	if (init < dev->size) {
+		storage_fetch(dev, init, dev->size - init);
+		memset(dev->base + init, 0xFF, dev->size - init);
+	}
+
+	return dev;
 }
@@ -1,13 +1,106 @@
 #ifndef __CHAR_DEVICE_H
 #define __CHAR_DEVICE_H
 
+#include <stdint.h>
+#include <sys/types.h>
+
+struct storage_stats {
+	unsigned long reads;		/* read transfers */
+	unsigned long bytes_read;
+	unsigned long writes;		/* write transfers */
+	unsigned long bytes_written;
+	unsigned long write_skip;	/* read write units found unchanged */
+	unsigned long erases;		/* erase operations */
+	unsigned long long delay_ns;	/* emulated device time */
+};
+
+/*
+ * Page cache of paged storage, pages are read by storage_fetch() before
+ * use and changed ones are written back on close. Backs slow devices
+ * where mapping the whole file reads it all. Pages stay cached once read.
+ */
+struct storage_cache {
+	size_t page;
+	size_t pages;
+	/* PAGE_* state per page */
+	uint8_t *state;
+	/* Contents as last read or written, changes are found against it */
+	uint8_t *orig;
+	/* Read ahead limit and current window in pages, grown on sequential reads */
+	size_t ahead;
+	size_t window;
+	/* Page following the last read, reads there are sequential */
+	size_t next;
+	/* Emulated device latency per byte and per transfer */
+	unsigned long byte_ns;
+	unsigned long xfer_ns;
+	/* Emulated write cycle of page write devices */
+	unsigned long wcycle_ns;
+	int report;
+	struct storage_stats stats;
+};
+
+/* Durability of changes on close */
+enum storage_sync {
+	STORAGE_SYNC_FULL,	/* data and metadata, default */
+	STORAGE_SYNC_RANGE,	/* written data only */
+	STORAGE_SYNC_NONE,	/* left to the kernel, e.g. one syncfs after a batch */
+};
+
+/* Opened for reading, changes are kept in memory only */
+#define STORAGE_RDONLY 0x01
+/* Run failed, an atomic update is dropped on close */
+#define STORAGE_DISCARD 0x02
+
+struct storage_device;
+
+struct storage_backend {
+	const char *name;
+	int def;
+
+	/*
+	 * Opens the device and sets its size and erase geometry. Returns
+	 * count of initialised bytes, the rest up to size is set empty.
+	 */
+	ssize_t (*open)(struct storage_device *dev, const char *file_name,
+			size_t pref_size, const char *opts);
+	void (*close)(struct storage_device *dev);
+	/* Optional, direct access to the whole storage, paged over read otherwise */
+	void *(*map)(struct storage_device *dev);
+	void (*unmap)(struct storage_device *dev);
+	ssize_t (*read)(struct storage_device *dev, void *buf, size_t len, off_t off);
+	/* Erase blocks are erased before they are written */
+	ssize_t (*write)(struct storage_device *dev, const void *buf, size_t len, off_t off);
+	int (*erase)(struct storage_device *dev, off_t off, size_t len);
+	/* Makes written data durable as set by the device sync mode */
+	int (*sync)(struct storage_device *dev);
+};
+
 struct storage_device {
+	const struct storage_backend *ops;
+	int flags;
+	enum storage_sync sync;
 	int fd;
+	void *priv;
 	void *base;
 	size_t size;
+	/*
+	 * Erase block and write unit, 0 when rewritten in place. A write of
+	 * devices without erase blocks must not cross a write unit (page).
+	 */
+	size_t erase_size;
+	size_t write_size;
+	/* NULL when the storage is mapped, paged storage is fetched before use */
+	struct storage_cache *cache;
 };
 
-struct storage_device *storage_open(const char *file_name, int pref_size);
+int storage_register(struct storage_backend *ops);
+struct storage_device *storage_open(const char *backend, const char *file_name,
+				    int pref_size, int flags, const char *opts);
+int storage_fetch(struct storage_device *dev, size_t off, size_t len);
+int storage_fetch_addr(void *dev, const void *addr, size_t len);
+void storage_readahead(struct storage_device *dev, size_t off, size_t len);
+void storage_discard(struct storage_device *dev);
 void storage_close(struct storage_device *dev);
 
 #endif /* __CHAR_DEVICE_H */
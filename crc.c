@@ -90,24 +90,347 @@ const uint32_t crc_tab32[256] = {
 
 #define	CRC_START_32 0xFFFFFFFFul
 
-uint32_t crc_32(const unsigned char *input_str, size_t num_bytes)
+/*
+ * Kernels operate on the raw CRC register, i.e. before final inversion.
+ * Portable byte at a time table loop is used as the fallback, faster
+ * kernels are selected at startup by crc32_dispatch().
+ */
+typedef uint32_t (*crc32_kernel_t)(uint32_t crc, const unsigned char *buf, size_t len);
+
+static uint32_t crc32_bytewise(uint32_t crc, const unsigned char *buf, size_t len)
 {
-	uint32_t crc = CRC_START_32;
-	const unsigned char *ptr;
-	size_t a;
+	while (len--)
+		crc = (crc >> 8) ^ crc_tab32[(crc ^ (uint32_t) *buf++) & 0x000000FFul];
 
-	ptr = input_str;
+	return crc;
+}
 
-	if (!ptr)
-		return 0;
+static crc32_kernel_t crc32_kernel = crc32_bytewise;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <string.h>
 
-	for (a = 0; a < num_bytes; a++)
-		crc = (crc >> 8) ^ crc_tab32[(crc ^ (uint32_t) *ptr++) & 0x000000FFul];
+#define HAVE_CRC32_SLICE16
 
-	return (crc ^ 0xFFFFFFFFul);
+/* Slice-by-16: crc_tab32_slice[k][n] is CRC of byte n followed by k zeros */
+static uint32_t crc_tab32_slice[16][256];
+
+static void crc32_slice16_init(void)
+{
+	uint32_t crc;
+	int k, n;
+
+	for (n = 0; n < 256; n++)
+		crc_tab32_slice[0][n] = crc_tab32[n];
+
+	for (k = 1; k < 16; k++) {
+		for (n = 0; n < 256; n++) {
+			crc = crc_tab32_slice[k - 1][n];
+			crc_tab32_slice[k][n] = (crc >> 8) ^ crc_tab32[crc & 0xFF];
+		}
+	}
+}
+
+static inline uint32_t crc32_load32(const unsigned char *buf)
+{
+	uint32_t val;
+
+	memcpy(&val, buf, sizeof(val));
+	return val;
+}
+
+#define SLICE(k, v, s) crc_tab32_slice[k][((v) >> (s)) & 0xFF]
+
+static uint32_t crc32_slice16(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	uint32_t a, b, c, d;
+
+	while (len >= 16) {
+		a = crc32_load32(buf) ^ crc;
+		b = crc32_load32(buf + 4);
+		c = crc32_load32(buf + 8);
+		d = crc32_load32(buf + 12);
+
+		crc = SLICE(15, a, 0) ^ SLICE(14, a, 8) ^ SLICE(13, a, 16) ^ SLICE(12, a, 24) ^
+		      SLICE(11, b, 0) ^ SLICE(10, b, 8) ^ SLICE(9, b, 16) ^ SLICE(8, b, 24) ^
+		      SLICE(7, c, 0) ^ SLICE(6, c, 8) ^ SLICE(5, c, 16) ^ SLICE(4, c, 24) ^
+		      SLICE(3, d, 0) ^ SLICE(2, d, 8) ^ SLICE(1, d, 16) ^ SLICE(0, d, 24);
+
+		buf += 16;
+		len -= 16;
+	}
+
+	return crc32_bytewise(crc, buf, len);
+}
+#endif
+
+#if defined(__x86_64__) && defined(HAVE_CRC32_SLICE16)
+#include <immintrin.h>
+
+#define HAVE_CRC32_PCLMUL
+
+/*
+ * Carry-less multiplication folding, after Intel's "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction" (bit-reflected
+ * constants k1..k5 and Barrett reduction). Requires len >= 64 and a
+ * multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+	static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((__m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((__m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((__m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((__m128i *)(buf + 0x30));
+
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((__m128i *)k1k2);
+
+	buf += 64;
+	len -= 64;
+
+	/* Parallel fold of 64 byte blocks */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((__m128i *)(buf + 0x00));
+		y6 = _mm_loadu_si128((__m128i *)(buf + 0x10));
+		y7 = _mm_loadu_si128((__m128i *)(buf + 0x20));
+		y8 = _mm_loadu_si128((__m128i *)(buf + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+		buf += 64;
+		len -= 64;
+	}
+
+	/* Fold into 128 bits */
+	x0 = _mm_load_si128((__m128i *)k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* Single fold of remaining 16 byte blocks */
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((__m128i *)buf);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		buf += 16;
+		len -= 16;
+	}
+
+	/* Fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((__m128i *)k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((__m128i *)poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	size_t cnt;
+
+	if (len >= 64) {
+		cnt = len & ~(size_t)15;
+		crc = crc32_pclmul_fold(crc, buf, cnt);
+		buf += cnt;
+		len -= cnt;
+	}
+
+	return crc32_slice16(crc, buf, len);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+#define HAVE_CRC32_ARMV8
+
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	uint64_t val;
+
+	while (len && ((uintptr_t)buf & 7)) {
+		crc = __crc32b(crc, *buf++);
+		len--;
+	}
+
+	while (len >= 8) {
+		val = *(const uint64_t *)buf;
+		crc = __crc32d(crc, val);
+		buf += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = __crc32b(crc, *buf++);
+
+	return crc;
+}
+#endif
+
+static void __attribute__((constructor)) crc32_dispatch(void)
+{
+#ifdef HAVE_CRC32_SLICE16
+	crc32_slice16_init();
+	crc32_kernel = crc32_slice16;
+#endif
+#ifdef HAVE_CRC32_PCLMUL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+		crc32_kernel = crc32_pclmul;
+#endif
+#ifdef HAVE_CRC32_ARMV8
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		crc32_kernel = crc32_armv8;
+#endif
+}
+
+uint32_t crc_32(const unsigned char *input_str, size_t num_bytes)
+{
+	if (!input_str)
+		return 0;
+
+	return crc32_kernel(CRC_START_32, input_str, num_bytes) ^ 0xFFFFFFFFul;
 }
 
 uint32_t update_crc_32(uint32_t crc, unsigned char c)
 {
 	return (crc >> 8) ^ crc_tab32[(crc ^ (uint32_t) c) & 0x000000FFul];
 }
+
+/*
+ * Continues crc_32() over next buffer, crc_32(a + b) equals to
+ * crc32_update(crc_32(a), b), crc32_update(0, b) equals to crc_32(b).
+ */
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+	return crc32_kernel(crc ^ 0xFFFFFFFFul, buf, len) ^ 0xFFFFFFFFul;
+}
+
+/*
+ * CRC combination math, as described by Mark Adler for zlib: CRC is a
+ * polynomial remainder, therefore appending N zero bytes to a message is
+ * a multiplication of its CRC by x^(8N) modulo the CRC polynomial.
+ */
+#define CRC_POLY_32 0xEDB88320ul
+
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1ul << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC_POLY_32 : b >> 1;
+	}
+
+	return p;
+}
+
+/* Returns x^(n * 2^k) modulo CRC polynomial */
+static uint32_t crc32_x2nmodp(size_t n, unsigned int k)
+{
+	static uint32_t x2n_tab32[32];
+	uint32_t p;
+	int i;
+
+	if (!x2n_tab32[0]) {
+		p = 1ul << 30;
+		for (i = 0; i < 32; i++) {
+			x2n_tab32[i] = p;
+			p = crc32_multmodp(p, p);
+		}
+	}
+
+	p = 1ul << 31;
+	while (n) {
+		if (n & 1)
+			p = crc32_multmodp(x2n_tab32[k & 31], p);
+		n >>= 1;
+		k++;
+	}
+
+	return p;
+}
+
+/*
+ * Advances raw (non inverted) CRC register as if num_zeros zero bytes
+ * were processed.
+ */
+uint32_t crc32_shift(uint32_t crc, size_t num_zeros)
+{
+	return crc32_multmodp(crc32_x2nmodp(num_zeros, 3), crc);
+}
+
+/*
+ * CRC-16 with reflected 0xA001 polynomial (libcrc crc_16), cheap enough
+ * bitwise for short records.
+ */
+uint16_t crc_16(const unsigned char *input_str, size_t num_bytes)
+{
+	uint16_t crc = 0;
+	int k;
+
+	while (num_bytes--) {
+		crc ^= *input_str++;
+		for (k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+
+	return crc;
+}
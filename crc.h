@@ -6,5 +6,8 @@
 
 uint32_t crc_32(const unsigned char *input_str, size_t num_bytes);
 uint32_t update_crc_32(uint32_t crc, unsigned char c);
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32_shift(uint32_t crc, size_t num_zeros);
+uint16_t crc_16(const unsigned char *input_str, size_t num_bytes);
 
 #endif /* __CRC32_H */
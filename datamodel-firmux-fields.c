@@ -37,15 +37,7 @@ static struct firmux_property plain_props[] = {
 
 static int firmux_fields_prop_is_set(void *sp, struct firmux_property *pprop)
 {
-	char *data = sp + pprop->fp_offset;
-	int size = pprop->fp_size;
-
-	while (size > 0 && (char)*data == (char)0xFF) {
-		data++;
-		size--;
-	}
-
-	return size > 0;
+	return !bempty_data(sp + pprop->fp_offset, pprop->fp_size);
 }
 
 static struct firmux_property *firmux_fields_prop_find(char *key)
@@ -187,8 +179,11 @@ static int firmux_fields_prop_store(void *sp, char *key, char *in)
 		return -1;
 	}
 
-	memcpy(base + pprop->fp_offset, data, size);
-	dirty = 1;
+	/* Leave storage untouched when value is unchanged */
+	if (memcmp(base + pprop->fp_offset, data, size)) {
+		memcpy(base + pprop->fp_offset, data, size);
+		dirty = 1;
+	}
 
 	free(data);
 	if (in[0] == '@')
@@ -226,10 +221,10 @@ static void firmux_fields_free(void *sp)
 {
 }
 
-static void *firmux_fields_init(struct storage_device *dev, int force)
+static void *firmux_fields_init(struct storage_device *dev, int force, const char *opts)
 {
 	struct firmux_header *fh;
-	int empty, idx = 0;
+	int empty;
 	unsigned int crc;
 
 	if (dev->size <= sizeof(*fh) + sizeof(struct firmux_fields)) {
@@ -239,17 +234,12 @@ static void *firmux_fields_init(struct storage_device *dev, int force)
 	}
 
 	fh = dev->base;
+	if (storage_fetch(dev, 0, sizeof(*fh) + sizeof(struct firmux_fields)))
+		return NULL;
 	if (!strncmp(fh->magic, EEPROM_MAGIC, sizeof(fh->magic)))
 		goto done;
 
-	empty = 1;
-	while (idx < sizeof(*fh)) {
-		if (((unsigned char *)dev->base)[idx] != 0xFF) {
-			empty = 0;
-			break;
-		}
-		idx++;
-	}
+	empty = bempty_data(dev->base, sizeof(*fh));
 
 	if (empty || force) {
 		if (force)
@@ -237,65 +237,69 @@ static int firmux_struct_prop_print(void *sp, char *key, char *out)
 	return 0;
 }
 
+/* Stores data into the field, marking storage dirty only on change */
+static int firmux_struct_data_store(void *field, void *data, size_t len)
+{
+	if (!memcmp(field, data, len))
+		return 0;
+
+	memcpy(field, data, len);
+	dirty = 1;
+
+	return 0;
+}
+
+/* Stores text into the field, terminating it when there is room left */
+static int firmux_struct_text_store(char *field, size_t size, char *val, size_t len)
+{
+	if (len > size)
+		return -1;
+
+	if (!memcmp(field, val, len) && (len == size || field[len] == '\0'))
+		return 0;
+
+	memcpy(field, val, len);
+	if (len < size)
+		field[len] = '\0';
+	dirty = 1;
+
+	return 0;
+}
+
 static int _firmux_struct_prop_store(void *sp, char *key, char *val, size_t len)
 {
 	struct firmux_fields *model = sp;
 
 	if (!strcmp(key, "PRODUCT_ID")) {
-		if (len > sizeof(model->product_id))
-			return -1;
-
-		strcpy(model->product_id, val);
+		return firmux_struct_text_store(model->product_id, sizeof(model->product_id), val, len);
 	} else if (!strcmp(key, "PRODUCT_NAME")) {
-		if (len > sizeof(model->product_name))
-			return -1;
-
-		strcpy(model->product_name, val);
+		return firmux_struct_text_store(model->product_name, sizeof(model->product_name), val, len);
 	} else if (!strcmp(key, "SERIAL_NO")) {
-		if (len > sizeof(model->serial_no))
-			return -1;
-
-		strcpy(model->serial_no, val);
+		return firmux_struct_text_store(model->serial_no, sizeof(model->serial_no), val, len);
 	} else if (!strcmp(key, "PCB_NAME")) {
-		if (len > sizeof(model->pcb_name))
-			return -1;
-
-		strcpy(model->pcb_name, val);
+		return firmux_struct_text_store(model->pcb_name, sizeof(model->pcb_name), val, len);
 	} else if (!strcmp(key, "PCB_REVISION")) {
-		if (len > sizeof(model->pcb_revision))
-			return -1;
-
-		strcpy(model->pcb_revision, val);
+		return firmux_struct_text_store(model->pcb_revision, sizeof(model->pcb_revision), val, len);
 	} else if (!strcmp(key, "PCB_PRDATE")) {
 		unsigned char date[3];
 		if (sscanf(val, "%hhu-%hhu-%hhu", &date[0], &date[1], &date[2]) != 3)
 			return -1;
 
-		memcpy(model->pcb_prdate, date, sizeof(model->pcb_prdate));
+		return firmux_struct_data_store(model->pcb_prdate, date, sizeof(date));
 	} else if (!strcmp(key, "PCB_PRLOCATION")) {
-		if (len > sizeof(model->pcb_prlocation))
-			return -1;
-
-		strcpy(model->pcb_prlocation, val);
+		return firmux_struct_text_store(model->pcb_prlocation, sizeof(model->pcb_prlocation), val, len);
 	} else if (!strcmp(key, "PCB_SN")) {
-		if (len > sizeof(model->pcb_serial))
-			return -1;
-
-		strcpy(model->pcb_serial, val);
+		return firmux_struct_text_store(model->pcb_serial, sizeof(model->pcb_serial), val, len);
 	} else if (!strcmp(key, "MAC_ADDR")) {
 		unsigned char mac[6];
 		if (sscanf(val, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
 			   &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) != 6)
 			return -1;
 
-		memcpy(model->mac_addr, mac, sizeof(model->mac_addr));
+		return firmux_struct_data_store(model->mac_addr, mac, sizeof(mac));
 	} else {
 		return -1;
 	}
-
-	dirty = 1;
-
-	return 0;
 }
 
 static int firmux_struct_prop_store(void *sp, char *key, char *in)
@@ -357,10 +361,10 @@ static void firmux_struct_free(void *sp)
 {
 }
 
-static void *firmux_struct_init(struct storage_device *dev, int force)
+static void *firmux_struct_init(struct storage_device *dev, int force, const char *opts)
 {
 	struct firmux_header *fh;
-	int empty, idx = 0;
+	int empty;
 	unsigned int crc;
 
 	if (dev->size <= sizeof(*fh) + sizeof(struct firmux_fields)) {
@@ -370,17 +374,12 @@ static void *firmux_struct_init(struct storage_device *dev, int force)
 	}
 
 	fh = dev->base;
+	if (storage_fetch(dev, 0, sizeof(*fh) + sizeof(struct firmux_fields)))
+		return NULL;
 	if (!strncmp(fh->magic, EEPROM_MAGIC, sizeof(fh->magic)))
 		goto done;
 
-	empty = 1;
-	while (idx < sizeof(*fh)) {
-		if (((unsigned char *)dev->base)[idx] != 0xFF) {
-			empty = 0;
-			break;
-		}
-		idx++;
-	}
+	empty = bempty_data(dev->base, sizeof(*fh));
 
 	if (empty || force) {
 		if (force)
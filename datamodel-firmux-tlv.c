@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,17 +19,187 @@
 
 #define EEPROM_MAGIC "FXDMTLV"
 #define EEPROM_VERSION 1
+#define EEPROM_VERSION_V2 2
+#define EEPROM_VERSION_MASK 0x07
+/* Header flags, kept in the version byte */
+#define EEPROM_FLAG_SORTED 0x80
+/* Append-only log, header len and crc are not maintained */
+#define EEPROM_FLAG_LOG 0x40
+/* Two copies in device halves, the valid one of newer generation is used */
+#define EEPROM_FLAG_BANKS 0x20
+/* Partition table follows the header, see struct tlv_part_table */
+#define EEPROM_FLAG_PARTS 0x10
+/* Values end with crc_16(), whole storage crc is not verified */
+#define EEPROM_FLAG_RECCRC 0x08
 
 #ifndef TLVS_DEFAULT_COMPRESSION
 #define TLVS_DEFAULT_COMPRESSION (9 | LZMA_PRESET_EXTREME)
 #endif
 
+struct firmux_tlv_part {
+	struct tlv_store *tlvs;
+	/* Header of the storage area the store works on */
+	struct tlv_header *hdr;
+	/* Types routed to the partition, partition 0 takes the rest */
+	uint8_t first;
+	uint8_t last;
+};
+
+struct firmux_tlv {
+	struct storage_device *dev;
+	struct firmux_tlv_part parts[EEPROM_PARTS_MAX + 1];
+	int parts_cnt;
+	/* Dual bank layout, spare bank is written and committed by flush */
+	struct tlv_bank_header *banks[2];
+	size_t bank_size;
+	int bank;
+	int pending;
+	uint32_t gen;
+	/* Record crc mode, types verified since open */
+	int reccrc;
+	uint8_t checked[TLV_TYPES / 8];
+	/* Mode changes of the options, applied by a commit without failures */
+	int set_reccrc;
+	int set_sorted;
+	int set_version;
+	int failed;
+};
+
+/* Moves the store onto the spare bank before its first change */
+static int firmux_tlv_bank_switch(struct firmux_tlv *ctx)
+{
+	struct tlv_bank_header *src, *dst;
+	size_t written;
+
+	if (!ctx->banks[0] || ctx->pending)
+		return 0;
+
+	src = ctx->banks[ctx->bank];
+	dst = ctx->banks[!ctx->bank];
+	if (storage_fetch_addr(ctx->dev, src, ctx->bank_size) ||
+	    storage_fetch_addr(ctx->dev, dst, ctx->bank_size))
+		return -EIO;
+	/* Spare bank holds the previous generation, only differences are written */
+	written = bcopy_diff(dst, src, offsetof(struct tlv_header, crc));
+	written += bcopy_diff(dst + 1, src + 1, ctx->bank_size - sizeof(*dst));
+	ldebug("Switched to storage bank %d, %zu bytes copied", !ctx->bank, written);
+
+	tlvs_rebase(ctx->parts[0].tlvs, dst + 1);
+	ctx->parts[0].hdr = &dst->hdr;
+	ctx->bank = !ctx->bank;
+	ctx->pending = 1;
+
+	return 0;
+}
+
+static struct tlv_store *firmux_tlv_route(struct firmux_tlv *ctx, enum tlv_code code)
+{
+	int i;
+
+	for (i = 1; i < ctx->parts_cnt; i++)
+		if (code >= ctx->parts[i].first && code <= ctx->parts[i].last)
+			return ctx->parts[i].tlvs;
+
+	return ctx->parts[0].tlvs;
+}
+
+struct firmux_tlv_gather {
+	unsigned char *buf;
+	size_t len;
+};
+
+static int firmux_tlv_gather_chunk(void *arg, const void *data, size_t len)
+{
+	struct firmux_tlv_gather *gather = arg;
+
+	memcpy(gather->buf + gather->len, data, len);
+	gather->len += len;
+	return 0;
+}
+
+/* Verifies record crc on first access, strips it from the value view */
+static int firmux_tlv_check(struct firmux_tlv *ctx, struct tlv_store *tlvs,
+			    enum tlv_code code, struct tlv_view *view)
+{
+	struct firmux_tlv_gather gather = { NULL, 0 };
+	const unsigned char *data = view->data;
+	ssize_t size;
+	int bad;
+
+	if (!ctx->reccrc)
+		return 0;
+
+	size = tlvs_size(tlvs, code);
+	if (size < 2)
+		goto damaged;
+
+	if (!(ctx->checked[code / 8] & (1 << code % 8))) {
+		if (size > (ssize_t)view->len) {
+			gather.buf = malloc(size);
+			if (!gather.buf) {
+				perror("malloc() failed");
+				return -1;
+			}
+			tlvs_read_chunks(tlvs, code, firmux_tlv_gather_chunk, &gather);
+			data = gather.buf;
+		}
+		bad = crc_16(data, size - 2) != (data[size - 2] << 8 | data[size - 1]);
+		free(gather.buf);
+		if (bad)
+			goto damaged;
+		ctx->checked[code / 8] |= 1 << code % 8;
+	}
+
+	/* Continuation records keep the crc, see firmux_tlv_prop_output() */
+	if (size == (ssize_t)view->len)
+		view->len -= 2;
+
+	return 0;
+damaged:
+	lerror("Damaged TLV record type %d", code);
+	return -1;
+}
+
+/* Tells whether the value is stored already, long values included */
+static int firmux_tlv_same(struct tlv_store *tlvs, enum tlv_code code,
+			   const void *data, size_t size)
+{
+	struct firmux_tlv_gather gather = { NULL, 0 };
+	struct tlv_view view;
+	int same;
+
+	if (tlvs_size(tlvs, code) != (ssize_t)size || tlvs_view(tlvs, code, &view))
+		return 0;
+
+	if (view.len == size)
+		return !memcmp(view.data, data, size);
+
+	gather.buf = malloc(size);
+	if (!gather.buf)
+		return 0;
+	tlvs_read_chunks(tlvs, code, firmux_tlv_gather_chunk, &gather);
+	same = !memcmp(gather.buf, data, size);
+	free(gather.buf);
+
+	return same;
+}
+
+/* Switches banks before the first set that changes a value */
+static int firmux_tlv_bank_change(struct firmux_tlv *ctx, struct tlv_store *tlvs,
+				  enum tlv_code code, const void *data, size_t size)
+{
+	if (!ctx->banks[0] || ctx->pending || firmux_tlv_same(tlvs, code, data, size))
+		return 0;
+
+	return firmux_tlv_bank_switch(ctx);
+}
+
 static int data_dump(const char *key, void *val, int len, enum tlv_spec type)
 {
 	int i;
 
 	if (type == INPUT_SPEC_TXT) {
-		printf("%s=%s\n", key, (char *)val);
+		printf("%s=%.*s\n", key, len, (char *)val);
 	} else if (type == INPUT_SPEC_BIN) {
 		printf("%s[%d] {", key, len);
 		for (i = 0; i < len; i++) {
@@ -239,6 +411,94 @@ static ssize_t tlvp_decompress_bin(void **data_out, void *data_in, size_t size_i
 	*data_out = out_tmp;
 	return size_out;
 }
+
+struct tlvp_decoder {
+	lzma_stream strm;
+	unsigned char *out_buf;
+	size_t out_size;
+	size_t size_inc;
+	int done;
+};
+
+static int tlvp_decompress_chunk(void *arg, const void *data, size_t len)
+{
+	struct tlvp_decoder *dec = arg;
+	unsigned char *out_tmp;
+	lzma_ret ret;
+
+	if (dec->done)
+		return 0;
+
+	dec->strm.next_in = data;
+	dec->strm.avail_in = len;
+
+	/* Empty input drains output still buffered in the decoder */
+	while (dec->strm.avail_in || !len) {
+		if (dec->strm.avail_out == 0) {
+			out_tmp = realloc(dec->out_buf, dec->out_size + dec->size_inc);
+			if (!out_tmp) {
+				perror("realloc() failed");
+				return -1;
+			}
+			dec->strm.next_out = out_tmp + dec->out_size;
+			dec->strm.avail_out = dec->size_inc;
+			dec->out_buf = out_tmp;
+			dec->out_size += dec->size_inc;
+		}
+
+		ret = lzma_code(&dec->strm, LZMA_RUN);
+		if (ret == LZMA_STREAM_END) {
+			dec->done = 1;
+			break;
+		}
+		if (ret != LZMA_OK) {
+			ldebug("LZMA decompression error: %d", ret);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Decompresses value fed record by record, without assembling the input */
+static ssize_t tlvp_decompress_chunks(void **data_out, struct tlv_store *tlvs, enum tlv_code code)
+{
+	struct tlvp_decoder dec = { .strm = LZMA_STREAM_INIT };
+	unsigned char *out_tmp;
+	size_t size_out;
+	ssize_t size;
+	lzma_ret ret;
+
+	size = tlvs_size(tlvs, code);
+	if (size < 0)
+		return -1;
+
+	ret = lzma_auto_decoder(&dec.strm, UINT64_MAX, 0);
+	if (ret != LZMA_OK) {
+		ldebug("Failed to initialize LZMA decoder, error code: %d", ret);
+		return -1;
+	}
+
+	dec.size_inc = size * 4;
+	if (tlvs_read_chunks(tlvs, code, tlvp_decompress_chunk, &dec) ||
+	    tlvp_decompress_chunk(&dec, NULL, 0) || !dec.done) {
+		lzma_end(&dec.strm);
+		free(dec.out_buf);
+		return -1;
+	}
+
+	lzma_end(&dec.strm);
+
+	size_out = dec.out_size - dec.strm.avail_out;
+	out_tmp = realloc(dec.out_buf, size_out);
+	if (!out_tmp) {
+		free(dec.out_buf);
+		return -1;
+	}
+
+	*data_out = out_tmp;
+	return size_out;
+}
 #else
 static ssize_t tlvp_compress_bin(void **data_out, void *data_in, size_t size_in)
 {
@@ -249,21 +509,36 @@ static ssize_t tlvp_decompress_bin(void **data_out, void *data_in, size_t size_i
 {
 	return acopy_data(data_out, data_in, size_in);
 }
+
+#define tlvp_decompress_chunks NULL
 #endif
 
 static struct tlv_property tlv_properties[] = {
-	{ "PRODUCT_ID", EEPROM_ATTR_PRODUCT_ID, INPUT_SPEC_TXT, acopy_data, acopy_data },
-	{ "PRODUCT_NAME", EEPROM_ATTR_PRODUCT_NAME, INPUT_SPEC_TXT, acopy_data, acopy_data },
-	{ "SERIAL_NO", EEPROM_ATTR_SERIAL_NO, INPUT_SPEC_TXT, acopy_data, acopy_data },
-	{ "PCB_NAME", EEPROM_ATTR_PCB_NAME, INPUT_SPEC_TXT, acopy_data, acopy_data },
-	{ "PCB_REVISION", EEPROM_ATTR_PCB_REVISION, INPUT_SPEC_TXT, acopy_data, acopy_data },
-	{ "PCB_PRDATE", EEPROM_ATTR_PCB_PRDATE, INPUT_SPEC_TXT, aparse_byte_triplet, aformat_byte_triplet },
-	{ "PCB_PRLOCATION", EEPROM_ATTR_PCB_PRLOCATION, INPUT_SPEC_TXT, acopy_data, acopy_data },
-	{ "PCB_SN", EEPROM_ATTR_PCB_SN, INPUT_SPEC_TXT, acopy_data, acopy_data },
-	{ "XTAL_CALDATA", EEPROM_ATTR_XTAL_CAL_DATA, INPUT_SPEC_BIN, tlvp_input_bin, tlvp_output_bin },
-	{ "RADIO_CALDATA", EEPROM_ATTR_RADIO_CAL_DATA, INPUT_SPEC_BIN, tlvp_compress_bin, tlvp_decompress_bin },
-	{ "RADIO_BRDDATA", EEPROM_ATTR_RADIO_BOARD_DATA, INPUT_SPEC_BIN, tlvp_compress_bin, tlvp_decompress_bin },
-	{ NULL, EEPROM_ATTR_NONE, INPUT_SPEC_NONE, NULL, NULL, }
+	{ .tlvp_name = "PRODUCT_ID", .tlvp_id = EEPROM_ATTR_PRODUCT_ID, .tlvp_spec = INPUT_SPEC_TXT,
+	  .tlvp_parse = acopy_data, .tlvp_format = acopy_data, .tlvp_reserve = 16 },
+	{ .tlvp_name = "PRODUCT_NAME", .tlvp_id = EEPROM_ATTR_PRODUCT_NAME, .tlvp_spec = INPUT_SPEC_TXT,
+	  .tlvp_parse = acopy_data, .tlvp_format = acopy_data, .tlvp_reserve = 32 },
+	{ .tlvp_name = "SERIAL_NO", .tlvp_id = EEPROM_ATTR_SERIAL_NO, .tlvp_spec = INPUT_SPEC_TXT,
+	  .tlvp_parse = acopy_data, .tlvp_format = acopy_data, .tlvp_reserve = 24 },
+	{ .tlvp_name = "PCB_NAME", .tlvp_id = EEPROM_ATTR_PCB_NAME, .tlvp_spec = INPUT_SPEC_TXT,
+	  .tlvp_parse = acopy_data, .tlvp_format = acopy_data },
+	{ .tlvp_name = "PCB_REVISION", .tlvp_id = EEPROM_ATTR_PCB_REVISION, .tlvp_spec = INPUT_SPEC_TXT,
+	  .tlvp_parse = acopy_data, .tlvp_format = acopy_data },
+	{ .tlvp_name = "PCB_PRDATE", .tlvp_id = EEPROM_ATTR_PCB_PRDATE, .tlvp_spec = INPUT_SPEC_TXT,
+	  .tlvp_parse = aparse_byte_triplet, .tlvp_format = aformat_byte_triplet },
+	{ .tlvp_name = "PCB_PRLOCATION", .tlvp_id = EEPROM_ATTR_PCB_PRLOCATION, .tlvp_spec = INPUT_SPEC_TXT,
+	  .tlvp_parse = acopy_data, .tlvp_format = acopy_data },
+	{ .tlvp_name = "PCB_SN", .tlvp_id = EEPROM_ATTR_PCB_SN, .tlvp_spec = INPUT_SPEC_TXT,
+	  .tlvp_parse = acopy_data, .tlvp_format = acopy_data, .tlvp_reserve = 24 },
+	{ .tlvp_name = "XTAL_CALDATA", .tlvp_id = EEPROM_ATTR_XTAL_CAL_DATA, .tlvp_spec = INPUT_SPEC_BIN,
+	  .tlvp_parse = tlvp_input_bin, .tlvp_format = tlvp_output_bin },
+	{ .tlvp_name = "RADIO_CALDATA", .tlvp_id = EEPROM_ATTR_RADIO_CAL_DATA, .tlvp_spec = INPUT_SPEC_BIN,
+	  .tlvp_parse = tlvp_compress_bin, .tlvp_format = tlvp_decompress_bin,
+	  .tlvp_format_chunks = tlvp_decompress_chunks },
+	{ .tlvp_name = "RADIO_BRDDATA", .tlvp_id = EEPROM_ATTR_RADIO_BOARD_DATA, .tlvp_spec = INPUT_SPEC_BIN,
+	  .tlvp_parse = tlvp_compress_bin, .tlvp_format = tlvp_decompress_bin,
+	  .tlvp_format_chunks = tlvp_decompress_chunks },
+	{ .tlvp_name = NULL }
 };
 
 static struct tlv_group tlv_groups[] = {
@@ -271,6 +546,25 @@ static struct tlv_group tlv_groups[] = {
 	{ NULL, EEPROM_ATTR_NONE, EEPROM_ATTR_NONE, INPUT_SPEC_NONE, NULL, NULL }
 };
 
+static struct tlv_property tlv_radio_properties[] = {
+	{ .tlvp_name = "CALDATA", .tlvp_id = EEPROM_RADIO_CAL_DATA, .tlvp_spec = INPUT_SPEC_BIN,
+	  .tlvp_parse = tlvp_compress_bin, .tlvp_format = tlvp_decompress_bin },
+	{ .tlvp_name = "BRDDATA", .tlvp_id = EEPROM_RADIO_BOARD_DATA, .tlvp_spec = INPUT_SPEC_BIN,
+	  .tlvp_parse = tlvp_compress_bin, .tlvp_format = tlvp_decompress_bin },
+	{ .tlvp_name = "CALDATA_2G", .tlvp_id = EEPROM_RADIO_CAL_DATA_2G, .tlvp_spec = INPUT_SPEC_BIN,
+	  .tlvp_parse = tlvp_compress_bin, .tlvp_format = tlvp_decompress_bin },
+	{ .tlvp_name = "CALDATA_5G", .tlvp_id = EEPROM_RADIO_CAL_DATA_5G, .tlvp_spec = INPUT_SPEC_BIN,
+	  .tlvp_parse = tlvp_compress_bin, .tlvp_format = tlvp_decompress_bin },
+	{ .tlvp_name = "CALDATA_6G", .tlvp_id = EEPROM_RADIO_CAL_DATA_6G, .tlvp_spec = INPUT_SPEC_BIN,
+	  .tlvp_parse = tlvp_compress_bin, .tlvp_format = tlvp_decompress_bin },
+	{ .tlvp_name = NULL }
+};
+
+static struct tlv_container tlv_containers[] = {
+	{ "RADIO", EEPROM_ATTR_RADIO_FIRST, EEPROM_ATTR_RADIO_LAST, tlv_radio_properties },
+	{ NULL, EEPROM_ATTR_NONE, EEPROM_ATTR_NONE, NULL }
+};
+
 static struct tlv_property *firmux_tlv_prop_find(char *key)
 {
 	struct tlv_property *tlvp;
@@ -315,55 +609,223 @@ static struct tlv_group *firmux_tlv_param_find(char *key, char **param)
 	return tlvg;
 }
 
-static enum tlv_code firmux_tlv_param_slot(struct tlv_store *tlvs, struct tlv_group *tlvg, char *param, int exact)
+/* Resolves path key <pattern><index>/<member> to container code and member */
+static struct tlv_property *firmux_tlv_path_find(char *key, enum tlv_code *code)
 {
-	enum tlv_code code, slot = EEPROM_ATTR_NONE;
-	char *extra;
-	void *data = NULL;
-	int data_len = 0;
-	ssize_t size;
+	struct tlv_container *tlvc;
+	struct tlv_property *tlvp;
+	unsigned int idx;
+	int n = 0;
 
-	for (code = tlvg->tlvg_id_first; code <= tlvg->tlvg_id_last; code++) {
-		size = tlvs_get(tlvs, code, 0, NULL);
-		if (size < 0) {
-			if (!exact && (slot == EEPROM_ATTR_NONE))
-				slot = code;
-			continue;
+	tlvc = &tlv_containers[0];
+	while (tlvc->tlvc_pattern) {
+		if (!strncmp(tlvc->tlvc_pattern, key, strlen(tlvc->tlvc_pattern)))
+			break;
+		tlvc++;
+	}
+
+	if (!tlvc->tlvc_pattern)
+		return NULL;
+
+	key += strlen(tlvc->tlvc_pattern);
+	if (sscanf(key, "%u/%n", &idx, &n) != 1 || !n ||
+	    idx > tlvc->tlvc_id_last - tlvc->tlvc_id_first)
+		return NULL;
+
+	tlvp = tlvc->tlvc_props;
+	while (tlvp->tlvp_name) {
+		if (!strcmp(tlvp->tlvp_name, key + n))
+			break;
+		tlvp++;
+	}
+
+	if (!tlvp->tlvp_name)
+		return NULL;
+
+	*code = tlvc->tlvc_id_first + idx;
+	return tlvp;
+}
+
+static struct tlv_container *firmux_tlv_container_find(enum tlv_code code)
+{
+	struct tlv_container *tlvc;
+
+	tlvc = &tlv_containers[0];
+	while (tlvc->tlvc_pattern) {
+		if (tlvc->tlvc_id_first <= code && tlvc->tlvc_id_last >= code)
+			return tlvc;
+		tlvc++;
+	}
+
+	return NULL;
+}
+
+/* Opens container record as a nested store, only its own bytes are read */
+static struct tlv_store *firmux_tlv_container_open(struct firmux_tlv *ctx, enum tlv_code code)
+{
+	struct tlv_store *tlvs, *sub;
+	struct tlv_view view;
+
+	tlvs = firmux_tlv_route(ctx, code);
+	if (tlvs_view(tlvs, code, &view))
+		return NULL;
+
+	if (firmux_tlv_check(ctx, tlvs, code, &view))
+		return NULL;
+
+	sub = tlvs_init_nested(tlvs, &view);
+	if (!sub)
+		lerror("Damaged TLV container type %d", code);
+
+	return sub;
+}
+
+/* Rewrites container record with the member set, siblings are untouched */
+static int firmux_tlv_container_store(struct firmux_tlv *ctx, enum tlv_code code,
+				      enum tlv_code member, void *data, size_t size)
+{
+	struct tlv_store *tlvs, *sub;
+	struct tlv_view view = { NULL, 0 };
+	unsigned char *buf;
+	size_t cap, len;
+	uint16_t crc;
+	int ret;
+
+	/* Members are plain records, the container must hold one as well */
+	if (size > TLV_HEAD_MAX) {
+		lerror("TLV container member %d is too large, size %zu", member, size);
+		return -1;
+	}
+
+	tlvs = firmux_tlv_route(ctx, code);
+	if (!tlvs_view(tlvs, code, &view) && firmux_tlv_check(ctx, tlvs, code, &view))
+		return -1;
+
+	/* Current members, new record with its header, end marker and crc */
+	cap = view.len + size + 8;
+	buf = malloc(cap);
+	if (!buf) {
+		perror("malloc() failed");
+		return -1;
+	}
+	memset(buf, EEPROM_ATTR_EMPTY, cap);
+	if (view.len)
+		memcpy(buf, view.data, view.len);
+
+	sub = tlvs_init_format(buf, cap, tlvs->format);
+	if (!sub) {
+		free(buf);
+		return -1;
+	}
+
+	ret = tlvs_set(sub, member, size, data);
+	if (!ret) {
+		tlvs_optimise(sub);
+		len = tlvs_len(sub) + 1;
+		if (ctx->reccrc) {
+			crc = crc_16(buf, len);
+			buf[len++] = crc >> 8;
+			buf[len++] = crc;
 		}
-		if (data_len < size) {
-			data_len = size;
-			data = realloc(data, size);
-			if (!data) {
-				perror("realloc() failed");
-				break;
-			}
+		/* Container is a single record for the nested store to map it */
+		if (len > TLV_HEAD_MAX) {
+			lerror("TLV container type %d is too large, size %zu", code, len);
+			ret = -1;
+		} else {
+			ret = firmux_tlv_bank_change(ctx, tlvs, code, buf, len);
+			if (!ret)
+				ret = tlvs_set(tlvs, code, len, buf);
+			if (!ret)
+				ctx->checked[code / 8] |= 1 << code % 8;
 		}
+	}
+
+	tlvs_free(sub);
+	free(buf);
+	return ret;
+}
+
+/* Marks types named by key ending with '*': properties, groups and containers of the prefix */
+static int firmux_tlv_prop_match(const char *key, uint8_t *types)
+{
+	struct tlv_property *tlvp;
+	struct tlv_container *tlvc;
+	struct tlv_group *tlvg;
+	size_t len = strlen(key);
+	int code, cnt = 0;
 
-		if (tlvs_get(tlvs, code, size, data) < 0) {
-			if (!exact && (slot == EEPROM_ATTR_NONE))
-				slot = code;
+	if (!len || key[len - 1] != '*')
+		return 0;
+	len--;
+
+	for (tlvp = &tlv_properties[0]; tlvp->tlvp_name; tlvp++) {
+		if (strncmp(tlvp->tlvp_name, key, len))
 			continue;
-		}
+		types[tlvp->tlvp_id / 8] |= 1 << tlvp->tlvp_id % 8;
+		cnt++;
+	}
 
-		if (tlvg->tlvg_format(NULL, data, size, &extra) < 0)
+	for (tlvg = &tlv_groups[0]; tlvg->tlvg_pattern; tlvg++) {
+		if (strncmp(tlvg->tlvg_pattern, key, len))
 			continue;
+		for (code = tlvg->tlvg_id_first; code <= tlvg->tlvg_id_last; code++)
+			types[code / 8] |= 1 << code % 8;
+		cnt++;
+	}
 
-		if (extra && !strcmp(extra, param)) {
-			slot = code;
-			break;
+	for (tlvc = &tlv_containers[0]; tlvc->tlvc_pattern; tlvc++) {
+		if (strncmp(tlvc->tlvc_pattern, key, len))
+			continue;
+		for (code = tlvc->tlvc_id_first; code <= tlvc->tlvc_id_last; code++)
+			types[code / 8] |= 1 << code % 8;
+		cnt++;
+	}
+
+	return cnt;
+}
+
+static enum tlv_code firmux_tlv_param_slot(struct firmux_tlv *ctx, struct tlv_group *tlvg, char *param, int exact)
+{
+	uint8_t used[TLV_TYPES / 8] = { 0 };
+	struct tlv_iterator iter;
+	struct tlv_field *tlv;
+	enum tlv_code code;
+	char *extra;
+	int i;
+
+	/* Only records of the group are visited */
+	for (i = 0; i < ctx->parts_cnt; i++) {
+		tlvs_iter_init_range(&iter, ctx->parts[i].tlvs, tlvg->tlvg_id_first, tlvg->tlvg_id_last);
+		while ((tlv = tlvs_iter_next(&iter)) != NULL) {
+			used[tlv->type / 8] |= 1 << tlv->type % 8;
+
+			if (firmux_tlv_check(ctx, ctx->parts[i].tlvs, tlv->type, &iter.view))
+				continue;
+
+			if (tlvg->tlvg_format(NULL, (void *)iter.view.data, iter.view.len, &extra) < 0)
+				continue;
+
+			if (extra && !strcmp(extra, param))
+				return tlv->type;
 		}
 	}
 
-	if (data)
-		free(data);
+	if (exact)
+		return EEPROM_ATTR_NONE;
+
+	for (code = tlvg->tlvg_id_first; code <= tlvg->tlvg_id_last; code++)
+		if (!(used[code / 8] & 1 << code % 8))
+			return code;
 
-	return slot;
+	return EEPROM_ATTR_NONE;
 }
 
 static int firmux_tlv_prop_check(char *key, char *in)
 {
+	uint8_t types[TLV_TYPES / 8] = { 0 };
 	struct tlv_property *tlvp;
 	struct tlv_group *tlvg;
+	enum tlv_code code;
 	char *param;
 	char *val = NULL;
 	size_t len = 0;
@@ -376,6 +838,12 @@ static int firmux_tlv_prop_check(char *key, char *in)
 		len = strlen(in);
 	}
 
+	/* Prefix keys are only read */
+	if (firmux_tlv_prop_match(key, types)) {
+		ret = val ? -1 : 0;
+		goto out;
+	}
+
 	tlvg = firmux_tlv_param_find(key, &param);
 	if (tlvg) {
 		if (!val)
@@ -385,7 +853,9 @@ static int firmux_tlv_prop_check(char *key, char *in)
 		goto out;
 	}
 
-	tlvp = firmux_tlv_prop_find(key);
+	tlvp = firmux_tlv_path_find(key, &code);
+	if (!tlvp)
+		tlvp = firmux_tlv_prop_find(key);
 	if (tlvp) {
 		if (!val)
 			return 0;
@@ -427,7 +897,7 @@ static struct tlv_property *firmux_tlv_prop_format(struct tlv_field *tlv, char *
 	return tlvp;
 }
 
-static struct tlv_group *firmux_tlv_param_format(struct tlv_field *tlv, char **key)
+static struct tlv_group *firmux_tlv_param_format(struct tlv_field *tlv, struct tlv_view *view, char **key)
 {
 	struct tlv_group *tlvg;
 	ssize_t len;
@@ -448,7 +918,7 @@ static struct tlv_group *firmux_tlv_param_format(struct tlv_field *tlv, char **k
 		return NULL;
 
 	if (key) {
-		if (tlvg->tlvg_format(NULL, tlv->value, ntohs(tlv->length), &param) < 0)
+		if (tlvg->tlvg_format(NULL, (void *)view->data, view->len, &param) < 0)
 			return NULL;
 		*key = malloc(strlen(tlvg->tlvg_pattern) + strlen(param) + 2);
 		if (!*key)
@@ -459,20 +929,26 @@ static struct tlv_group *firmux_tlv_param_format(struct tlv_field *tlv, char **k
 	return tlvg;
 }
 
-static int firmux_tlv_prop_store(void *sp, char *key, char *in)
+static int firmux_tlv_prop_set(struct firmux_tlv *ctx, char *key, char *in)
 {
-	struct tlv_store *tlvs = (struct tlv_store *)sp;
+	struct tlv_store *tlvs;
 	struct tlv_property *tlvp;
 	struct tlv_group *tlvg;
 	enum tlv_code code;
 	char *param;
 	char *val;
 	void *data = NULL;
+	unsigned char *tmp;
 	ssize_t size, len;
+	uint16_t crc;
+	int path = 0;
 	int ret = -1;
 
-	if ((tlvg = firmux_tlv_param_find(key, &param))) {
-		code = firmux_tlv_param_slot(tlvs, tlvg, param, 0);
+	if ((tlvp = firmux_tlv_path_find(key, &code))) {
+		tlvg = NULL;
+		path = 1;
+	} else if ((tlvg = firmux_tlv_param_find(key, &param))) {
+		code = firmux_tlv_param_slot(ctx, tlvg, param, 0);
 		if (code == EEPROM_ATTR_NONE) {
 			ldebug("Failed TLV param '%s' slot lookup", param);
 			return -1;
@@ -483,6 +959,7 @@ static int firmux_tlv_prop_store(void *sp, char *key, char *in)
 		ldebug("Invalid TLV property '%s'", key);
 		return -1;
 	}
+	tlvs = firmux_tlv_route(ctx, code);
 
 	if (!in)
 		return -1;
@@ -504,7 +981,7 @@ static int firmux_tlv_prop_store(void *sp, char *key, char *in)
 			lerror("Failed TLV param '%s' parse, size %zu", param, len);
 			goto fail;
 		}
-	} else if (tlvp) {
+	} else {
 		size = tlvp->tlvp_parse(&data, val, len);
 		if (size < 0) {
 			lerror("Failed TLV property parse, size %zu", len);
@@ -512,7 +989,28 @@ static int firmux_tlv_prop_store(void *sp, char *key, char *in)
 		}
 	}
 
-	ret = tlvs_set(tlvs, code, size, data);
+	if (path) {
+		ret = firmux_tlv_container_store(ctx, code, tlvp->tlvp_id, data, size);
+		goto fail;
+	}
+
+	if (ctx->reccrc) {
+		tmp = realloc(data, size + 2);
+		if (!tmp) {
+			perror("realloc() failed");
+			goto fail;
+		}
+		crc = crc_16(tmp, size);
+		tmp[size++] = crc >> 8;
+		tmp[size++] = crc;
+		data = tmp;
+	}
+
+	ret = firmux_tlv_bank_change(ctx, tlvs, code, data, size);
+	if (!ret)
+		ret = tlvs_set_large(tlvs, code, size, data);
+	if (!ret)
+		ctx->checked[code / 8] |= 1 << code % 8;
 
 fail:
 	if (data)
@@ -522,11 +1020,105 @@ fail:
 	return ret;
 }
 
-static int firmux_tlv_print_all(struct tlv_store *tlvs)
+static int firmux_tlv_prop_store(void *sp, char *key, char *in)
+{
+	struct firmux_tlv *ctx = sp;
+	int ret;
+
+	ret = firmux_tlv_prop_set(ctx, key, in);
+	if (ret < 0)
+		ctx->failed = 1;
+	return ret;
+}
+
+/* Formats property value, continuation records of long values included */
+static ssize_t firmux_tlv_prop_output(struct firmux_tlv *ctx, struct tlv_store *tlvs,
+				      struct tlv_property *tlvp, void *data, size_t len, char **val)
+{
+	struct firmux_tlv_gather gather;
+	ssize_t size, ret;
+	size_t crc_len = ctx->reccrc ? 2 : 0;
+
+	size = tlvs_size(tlvs, tlvp->tlvp_id);
+	if (size <= (ssize_t)(len + crc_len))
+		return tlvp->tlvp_format((void **)val, data, len);
+
+	/* Record crc trails the last continuation record */
+	if (tlvp->tlvp_format_chunks && !crc_len)
+		return tlvp->tlvp_format_chunks((void **)val, tlvs, tlvp->tlvp_id);
+
+	gather.buf = malloc(size);
+	if (!gather.buf) {
+		perror("malloc() failed");
+		return -1;
+	}
+	gather.len = 0;
+
+	tlvs_read_chunks(tlvs, tlvp->tlvp_id, firmux_tlv_gather_chunk, &gather);
+	ret = tlvp->tlvp_format((void **)val, gather.buf, gather.len - crc_len);
+	free(gather.buf);
+
+	return ret;
+}
+
+static int firmux_tlv_print_container(struct firmux_tlv *ctx, struct tlv_store *tlvs,
+				      struct tlv_container *tlvc, enum tlv_code code,
+				      struct tlv_view *view)
 {
 	struct tlv_iterator iter;
 	struct tlv_field *tlv;
 	struct tlv_property *tlvp;
+	struct tlv_store *sub;
+	char key[64];
+	char *val;
+	ssize_t len;
+	int fail = 0;
+
+	sub = tlvs_init_nested(tlvs, view);
+	if (!sub) {
+		lerror("Damaged TLV container type %d", code);
+		return 1;
+	}
+
+	tlvs_iter_init(&iter, sub);
+
+	while ((tlv = tlvs_iter_next(&iter)) != NULL) {
+		tlvp = tlvc->tlvc_props;
+		while (tlvp->tlvp_name && tlvp->tlvp_id != tlv->type)
+			tlvp++;
+		if (!tlvp->tlvp_name) {
+			lerror("Invalid TLV %s%d member type '%i'", tlvc->tlvc_pattern,
+			       code - tlvc->tlvc_id_first, tlv->type);
+			fail++;
+			continue;
+		}
+
+		snprintf(key, sizeof(key), "%s%d/%s", tlvc->tlvc_pattern,
+			 code - tlvc->tlvc_id_first, tlvp->tlvp_name);
+		val = NULL;
+		len = tlvp->tlvp_format((void **)&val, (void *)iter.view.data, iter.view.len);
+		if (len < 0) {
+			lerror("Failed to format TLV param %s", key);
+			fail++;
+			continue;
+		}
+
+		data_dump(key, val, len, tlvp->tlvp_spec);
+		free(val);
+	}
+
+	tlvs_free(sub);
+	return fail;
+}
+
+/* Prints records of types set in the map, all of them without one */
+static int firmux_tlv_print_all(struct firmux_tlv *ctx, struct tlv_store *tlvs,
+				const uint8_t *types)
+{
+	struct tlv_iterator iter;
+	struct tlv_field *tlv;
+	struct tlv_property *tlvp;
+	struct tlv_container *tlvc;
 	struct tlv_group *tlvg;
 	enum tlv_spec spec;
 	char *key;
@@ -534,14 +1126,27 @@ static int firmux_tlv_print_all(struct tlv_store *tlvs)
 	ssize_t len;
 	int fail = 0;
 
-	tlvs_iter_init(&iter, tlvs);
+	if (types)
+		tlvs_iter_init_types(&iter, tlvs, types);
+	else
+		tlvs_iter_init(&iter, tlvs);
 
 	while ((tlv = tlvs_iter_next(&iter)) != NULL) {
 		val = NULL;
 		key = NULL;
 
-		if ((tlvg = firmux_tlv_param_format(tlv, &key))) {
-			len = tlvg->tlvg_format((void **)&val, tlv->value, ntohs(tlv->length), NULL);
+		if (firmux_tlv_check(ctx, tlvs, tlv->type, &iter.view)) {
+			fail++;
+			continue;
+		}
+
+		if ((tlvc = firmux_tlv_container_find(tlv->type))) {
+			fail += firmux_tlv_print_container(ctx, tlvs, tlvc, tlv->type, &iter.view);
+			continue;
+		}
+
+		if ((tlvg = firmux_tlv_param_format(tlv, &iter.view, &key))) {
+			len = tlvg->tlvg_format((void **)&val, (void *)iter.view.data, iter.view.len, NULL);
 			if (len < 0) {
 				lerror("Failed to format TLV param %s", key);
 				fail++;
@@ -549,7 +1154,7 @@ static int firmux_tlv_print_all(struct tlv_store *tlvs)
 			}
 			spec = tlvg->tlvg_spec;
 		} else if ((tlvp = firmux_tlv_prop_format(tlv, &key))) {
-			len = tlvp->tlvp_format((void **)&val, tlv->value, ntohs(tlv->length));
+			len = firmux_tlv_prop_output(ctx, tlvs, tlvp, (void *)iter.view.data, iter.view.len, &val);
 			if (len < 0) {
 				lerror("Failed to format TLV param %s", key);
 				fail++;
@@ -575,21 +1180,47 @@ next:
 
 static int firmux_tlv_prop_print(void *sp, char *key, char *out)
 {
-	struct tlv_store *tlvs = (struct tlv_store *)sp;
+	struct firmux_tlv *ctx = sp;
+	struct tlv_store *tlvs, *sub;
 	struct tlv_property *tlvp;
 	struct tlv_group *tlvg;
 	enum tlv_code code;
 	enum tlv_spec spec;
+	struct tlv_view view;
+	uint8_t types[TLV_TYPES / 8] = { 0 };
 	char *param;
 	char *val;
-	void *data;
-	ssize_t size, len;
+	ssize_t len;
+	int i, fail = 0;
 
-	if (!key)
-		return firmux_tlv_print_all(tlvs);
+	if (!key) {
+		for (i = 0; i < ctx->parts_cnt; i++)
+			fail += firmux_tlv_print_all(ctx, ctx->parts[i].tlvs, NULL);
+		return fail;
+	}
+
+	if (firmux_tlv_prop_match(key, types)) {
+		/* Only records of the matched types are visited */
+		for (i = 0; i < ctx->parts_cnt; i++)
+			fail += firmux_tlv_print_all(ctx, ctx->parts[i].tlvs, types);
+		return fail;
+	}
 
-	if ((tlvg = firmux_tlv_param_find(key, &param))) {
-		code = firmux_tlv_param_slot(tlvs, tlvg, param, 1);
+	if ((tlvp = firmux_tlv_path_find(key, &code))) {
+		/* Only the container of the path is read */
+		sub = firmux_tlv_container_open(ctx, code);
+		if (!sub || tlvs_view(sub, tlvp->tlvp_id, &view)) {
+			lerror("Failed TLV property '%s' get", key);
+			if (sub)
+				tlvs_free(sub);
+			return 1;
+		}
+		len = tlvp->tlvp_format((void **)&val, (void *)view.data, view.len);
+		spec = tlvp->tlvp_spec;
+		tlvs_free(sub);
+		goto out;
+	} else if ((tlvg = firmux_tlv_param_find(key, &param))) {
+		code = firmux_tlv_param_slot(ctx, tlvg, param, 1);
 		if (code == EEPROM_ATTR_NONE) {
 			ldebug("Failed TLV param '%s' slot lookup", param);
 			return -1;
@@ -600,34 +1231,26 @@ static int firmux_tlv_prop_print(void *sp, char *key, char *out)
 		ldebug("Invalid TLV property '%s'", key);
 		return -1;
 	}
+	tlvs = firmux_tlv_route(ctx, code);
 
-	size = tlvs_get(tlvs, code, 0, NULL);
-	if (size < 0) {
+	if (tlvs_view(tlvs, code, &view)) {
 		lerror("Failed TLV property '%s' get", key);
 		return 1;
 	}
 
-	data = malloc(size);
-	if (!data) {
-		perror("malloc() failed");
+	if (firmux_tlv_check(ctx, tlvs, code, &view))
 		return -1;
-	}
-
-	if (tlvs_get(tlvs, code, size, data) < 0) {
-		free(data);
-		return -1;
-	}
 
 	if (tlvg) {
-		len = tlvg->tlvg_format((void **)&val, data, size, NULL);
+		len = tlvg->tlvg_format((void **)&val, (void *)view.data, view.len, NULL);
 		spec = tlvg->tlvg_spec;
-	} else if (tlvp) {
-		len = tlvp->tlvp_format((void **)&val, data, size);
+	} else {
+		len = firmux_tlv_prop_output(ctx, tlvs, tlvp, (void *)view.data, view.len, &val);
 		spec = tlvp->tlvp_spec;
 	}
-	free(data);
+out:
 	if (len < 0) {
-		lerror("Failed TLV property format, size %zu", size);
+		lerror("Failed TLV property format, size %zu", view.len);
 		return -1;
 	}
 
@@ -646,6 +1269,7 @@ static int firmux_tlv_prop_print(void *sp, char *key, char *out)
 static void firmux_tlv_prop_list(void)
 {
 	struct tlv_property *tlvp;
+	struct tlv_container *tlvc;
 	struct tlv_group *tlvg;
 
 	tlvp = &tlv_properties[0];
@@ -659,78 +1283,595 @@ static void firmux_tlv_prop_list(void)
 		printf("%s*\n", tlvg->tlvg_pattern);
 		tlvg++;
 	}
+
+	tlvc = &tlv_containers[0];
+	while (tlvc->tlvc_pattern) {
+		for (tlvp = tlvc->tlvc_props; tlvp->tlvp_name; tlvp++)
+			printf("%s*/%s\n", tlvc->tlvc_pattern, tlvp->tlvp_name);
+		tlvc++;
+	}
+}
+
+static int firmux_tlv_format(int version)
+{
+	return (version & EEPROM_VERSION_MASK) == EEPROM_VERSION_V2 ?
+		TLV_FORMAT_V2 : TLV_FORMAT_V1;
+}
+
+static void firmux_tlv_mode_drop(struct firmux_tlv *ctx)
+{
+	ctx->set_reccrc = 0;
+	ctx->set_version = 0;
+	ctx->set_sorted = 0;
+}
+
+/* Header flags and format follow the records of the run, not before them */
+static int firmux_tlv_mode_apply(struct firmux_tlv *ctx)
+{
+	struct tlv_header *tlvh;
+	int i, sorted, ret = 0;
+
+	if (!ctx->set_reccrc && !ctx->set_version && !ctx->set_sorted)
+		return 0;
+
+	if (firmux_tlv_bank_switch(ctx)) {
+		lerror("Failed to read storage banks");
+		firmux_tlv_mode_drop(ctx);
+		return -EIO;
+	}
+	tlvh = ctx->parts[0].hdr;
+
+	if (ctx->set_version) {
+		ldebug("Migrating storage format %d to %d",
+		       tlvh->version & EEPROM_VERSION_MASK, ctx->set_version);
+		for (i = 0; i < ctx->parts_cnt; i++) {
+			ret = tlvs_convert(ctx->parts[i].tlvs, firmux_tlv_format(ctx->set_version));
+			if (ret < 0)
+				break;
+		}
+		if (ret < 0) {
+			lerror("Failed to migrate storage format: %s", strerror(-ret));
+			/* Converted partitions go back, their headers are untouched */
+			while (i--)
+				tlvs_convert(ctx->parts[i].tlvs,
+					     firmux_tlv_format(ctx->parts[i].hdr->version));
+			firmux_tlv_mode_drop(ctx);
+			return ret;
+		}
+		for (i = 0; i < ctx->parts_cnt; i++) {
+			ctx->parts[i].hdr->version &= ~EEPROM_VERSION_MASK;
+			ctx->parts[i].hdr->version |= ctx->set_version;
+			ctx->parts[i].tlvs->dirty = 1;
+		}
+		ctx->set_version = 0;
+	}
+
+	if (ctx->set_sorted) {
+		sorted = !(tlvh->version & EEPROM_FLAG_SORTED);
+		tlvh->version ^= EEPROM_FLAG_SORTED;
+		for (i = 0; i < ctx->parts_cnt; i++) {
+			tlvs_set_sorted(ctx->parts[i].tlvs, sorted);
+			/* Existing records are reordered once when enabled */
+			tlvs_optimise(ctx->parts[i].tlvs);
+			ctx->parts[i].tlvs->dirty = 1;
+		}
+		ctx->set_sorted = 0;
+	}
+
+	if (ctx->set_reccrc) {
+		tlvh->version |= EEPROM_FLAG_RECCRC;
+		ctx->parts[0].tlvs->dirty = 1;
+		ctx->set_reccrc = 0;
+	}
+
+	return 0;
 }
 
 static int firmux_tlv_flush(void *sp)
 {
-	struct tlv_store *tlvs = sp;
-	struct tlv_header *tlvh = tlvs->base - sizeof(*tlvh);
-	int len;
+	struct firmux_tlv *ctx = sp;
+	struct tlv_store *tlvs;
+	struct tlv_header *tlvh;
+	struct tlv_bank_header commit;
+	uint32_t crc;
+	int i, len, ret;
+
+	/* Storage is left in its old mode when the change does not fit */
+	ret = firmux_tlv_mode_apply(ctx);
 
-	if (tlvs->dirty) {
-		len = tlvs_len(sp);
+	for (i = 0; i < ctx->parts_cnt; i++) {
+		tlvs = ctx->parts[i].tlvs;
+		tlvh = ctx->parts[i].hdr;
+		if (!tlvs->dirty || tlvs->log)
+			continue;
+
+		len = tlvs_len(tlvs);
+		crc = tlvs_crc(tlvs);
 		tlvs->dirty = 0;
-		tlvh->len = htonl(len);
-		tlvh->crc = htonl(crc_32(tlvs->base, len));
+#ifdef DEBUG
+		if (crc != crc_32(tlvs->base, len))
+			lerror("Incremental storage crc mismatch");
+#endif
+
+		if (i || !ctx->banks[0]) {
+			tlvh->len = htonl(len);
+			tlvh->crc = htonl(crc);
+			continue;
+		}
+
+		/* Spare bank takes over with a single write of crc, len and gen */
+		commit.gen = htonl(ctx->gen + 1);
+		commit.hdr.len = htonl(len);
+		commit.hdr.crc = htonl(crc32_update(crc, &commit.gen, sizeof(commit.gen)));
+		memcpy(&tlvh->crc, &commit.hdr.crc,
+		       sizeof(commit) - offsetof(struct tlv_bank_header, hdr.crc));
+		ctx->gen++;
+		ctx->pending = 0;
+	}
+
+	return ret;
+}
+
+static int firmux_tlv_begin(void *sp)
+{
+	struct firmux_tlv *ctx = sp;
+	int i, ret;
+
+	ctx->failed = 0;
+	for (i = 0; i < ctx->parts_cnt; i++) {
+		ret = tlvs_begin(ctx->parts[i].tlvs);
+		if (ret < 0) {
+			while (i--)
+				tlvs_abort(ctx->parts[i].tlvs);
+			return ret;
+		}
 	}
 
 	return 0;
 }
 
+/*
+ * Changes of every partition are placed before any is written, all
+ * partitions are dropped when one does not fit. Mode changes are kept
+ * for flush only when every import of the run succeeded, a run with mode
+ * changes is dropped as a whole otherwise.
+ */
+static int firmux_tlv_commit(void *sp)
+{
+	struct firmux_tlv *ctx = sp;
+	int i, ret = 0;
+
+	if (ctx->failed && (ctx->set_reccrc || ctx->set_version || ctx->set_sorted)) {
+		lerror("Storage mode change dropped with failed imports");
+		firmux_tlv_mode_drop(ctx);
+		for (i = 0; i < ctx->parts_cnt; i++)
+			tlvs_abort(ctx->parts[i].tlvs);
+		return -ECANCELED;
+	}
+
+	for (i = 0; i < ctx->parts_cnt && !ret; i++)
+		ret = tlvs_prepare(ctx->parts[i].tlvs);
+	if (ret < 0) {
+		lerror("Failed TLV params commit: %s", strerror(-ret));
+		for (i = 0; i < ctx->parts_cnt; i++)
+			tlvs_abort(ctx->parts[i].tlvs);
+		firmux_tlv_mode_drop(ctx);
+		return ret;
+	}
+
+	/* Placed changes are only written out, which does not fail */
+	for (i = 0; i < ctx->parts_cnt; i++)
+		tlvs_commit(ctx->parts[i].tlvs);
+
+	return 0;
+}
+
 static void firmux_tlv_free(void *sp)
 {
-	tlvs_free((struct tlv_store *)sp);
+	struct firmux_tlv *ctx = sp;
+	int i;
+
+	for (i = 0; i < ctx->parts_cnt; i++)
+		tlvs_free(ctx->parts[i].tlvs);
+	free(ctx);
+}
+
+static int firmux_tlv_bank_valid(struct tlv_bank_header *bh, size_t size, uint32_t *crc)
+{
+	uint32_t data_crc;
+
+	if (strncmp(bh->hdr.magic, EEPROM_MAGIC, sizeof(bh->hdr.magic)) ||
+	    !(bh->hdr.version & EEPROM_FLAG_BANKS) || ntohl(bh->hdr.len) > size)
+		return 0;
+
+	data_crc = crc_32((unsigned char *)(bh + 1), ntohl(bh->hdr.len));
+	if (crc32_update(data_crc, &bh->gen, sizeof(bh->gen)) != ntohl(bh->hdr.crc))
+		return 0;
+
+	*crc = data_crc;
+	return 1;
+}
+
+/* Picks the valid bank of the newest generation */
+static struct tlv_header *firmux_tlv_bank_open(struct firmux_tlv *ctx,
+					       struct storage_device *dev, uint32_t *crc)
+{
+	struct tlv_bank_header *bh;
+	uint32_t crcs[2];
+	int valid[2], i;
+
+	ctx->bank_size = dev->size / 2;
+	for (i = 0; i < 2; i++) {
+		bh = ctx->banks[i] = dev->base + i * ctx->bank_size;
+		/* Bank crc covers the data its header counts */
+		valid[i] = !storage_fetch_addr(dev, bh, sizeof(*bh)) &&
+			   !storage_fetch_addr(dev, bh + 1, ntohl(bh->hdr.len)) &&
+			   firmux_tlv_bank_valid(bh, ctx->bank_size - sizeof(*bh), &crcs[i]);
+	}
+
+	if (!valid[0] && !valid[1])
+		return NULL;
+
+	ctx->bank = valid[1] && (!valid[0] ||
+		    (int32_t)(ntohl(ctx->banks[1]->gen) - ntohl(ctx->banks[0]->gen)) > 0);
+	ctx->gen = ntohl(ctx->banks[ctx->bank]->gen);
+	*crc = crcs[ctx->bank];
+
+	ldebug("Opened storage bank %d, generation %u", ctx->bank, ctx->gen);
+
+	return &ctx->banks[ctx->bank]->hdr;
 }
 
-static void *firmux_tlv_init(struct storage_device *dev, int force)
+/* Parses "<first>-<last>:<size>[+...]", partitions are laid out from the end */
+static int firmux_tlv_parts_format(struct storage_device *dev, const char *val)
 {
+	struct tlv_header *tlvh = dev->base, *ph;
+	struct tlv_part_table table;
+	unsigned int first, last, size;
+	size_t off = dev->size;
+	size_t min = sizeof(*tlvh) + sizeof(table);
+	int i, n, cnt = 0;
+
+	memset(&table, 0, sizeof(table));
+	while (1) {
+		if (cnt == EEPROM_PARTS_MAX ||
+		    sscanf(val, "%u-%u:%u%n", &first, &last, &size, &n) != 3 ||
+		    first < 1 || first > last || last > 0xFC ||
+		    size <= sizeof(*ph) || size >= off - min) {
+			lerror("Invalid storage partition '%s'", val);
+			return -1;
+		}
+		for (i = 0; i < cnt; i++) {
+			if (first <= table.part[i].last && last >= table.part[i].first) {
+				lerror("Overlapping storage partition '%s'", val);
+				return -1;
+			}
+		}
+
+		off -= size;
+		table.part[cnt].first = first;
+		table.part[cnt].last = last;
+		table.part[cnt].offset = htonl(off);
+		table.part[cnt].size = htonl(size);
+		cnt++;
+
+		val += n;
+		if (*val != '+')
+			break;
+		val++;
+	}
+
+	table.count = cnt;
+	table.crc = htonl(crc_32(&table.count, sizeof(table) - sizeof(table.crc)));
+
+	if (storage_fetch(dev, 0, dev->size))
+		return -1;
+	memset(dev->base + sizeof(*tlvh), 0xFF, dev->size - sizeof(*tlvh));
+	memcpy(tlvh + 1, &table, sizeof(table));
+	for (i = 0; i < cnt; i++) {
+		ph = dev->base + ntohl(table.part[i].offset);
+		memset(ph, 0, sizeof(*ph));
+		memcpy(ph->magic, EEPROM_MAGIC, sizeof(ph->magic));
+		ph->version = tlvh->version & EEPROM_VERSION_MASK;
+	}
+	tlvh->version |= EEPROM_FLAG_PARTS;
+
+	return 0;
+}
+
+/* Opens partitions of the table, returns offset where partition 0 ends */
+static size_t firmux_tlv_parts_open(struct firmux_tlv *ctx, struct storage_device *dev)
+{
+	struct tlv_part_table *table = dev->base + sizeof(struct tlv_header);
+	struct tlv_part *part;
+	struct tlv_header *ph;
+	struct tlv_store *tlvs;
+	size_t end = dev->size;
+	size_t off, size, min = sizeof(struct tlv_header) + sizeof(*table);
+	uint32_t crc;
+	int i;
+
+	if (dev->size <= min || storage_fetch(dev, sizeof(struct tlv_header), sizeof(*table)) ||
+	    table->count > EEPROM_PARTS_MAX ||
+	    ntohl(table->crc) != crc_32(&table->count, sizeof(*table) - sizeof(table->crc))) {
+		lerror("Invalid storage partition table");
+		return 0;
+	}
+
+	for (i = 0; i < table->count; i++) {
+		part = &table->part[i];
+		off = ntohl(part->offset);
+		size = ntohl(part->size);
+		if (off < min || size <= sizeof(*ph) || off + size > dev->size) {
+			lerror("Invalid storage partition %d", i);
+			return 0;
+		}
+
+		ph = dev->base + off;
+		if (storage_fetch(dev, off, sizeof(*ph)) ||
+		    (!ctx->reccrc && storage_fetch_addr(dev, ph + 1, ntohl(ph->len)))) {
+			lerror("Failed to read storage partition %d", i);
+			return 0;
+		}
+		crc = ntohl(ph->crc);
+		if (strncmp(ph->magic, EEPROM_MAGIC, sizeof(ph->magic)) ||
+		    ntohl(ph->len) > size - sizeof(*ph) ||
+		    (!ctx->reccrc && crc != crc_32((unsigned char *)(ph + 1), ntohl(ph->len)))) {
+			lerror("Invalid storage partition %d crc", i);
+			return 0;
+		}
+
+		tlvs = tlvs_init_paged(ph + 1, size - sizeof(*ph),
+				       (ph->version & EEPROM_VERSION_MASK) == EEPROM_VERSION_V2 ?
+				       TLV_FORMAT_V2 : TLV_FORMAT_V1,
+				       dev->cache ? storage_fetch_addr : NULL, dev);
+		if (!tlvs) {
+			lerror("Failed to initialize TLV store");
+			return 0;
+		}
+		tlvs_crc_init(tlvs, crc, ntohl(ph->len));
+
+		ctx->parts[ctx->parts_cnt].tlvs = tlvs;
+		ctx->parts[ctx->parts_cnt].hdr = ph;
+		ctx->parts[ctx->parts_cnt].first = part->first;
+		ctx->parts[ctx->parts_cnt].last = part->last;
+		ctx->parts_cnt++;
+
+		if (off < end)
+			end = off;
+	}
+
+	return end;
+}
+
+static void *firmux_tlv_init(struct storage_device *dev, int force, const char *opts)
+{
+	struct firmux_tlv *ctx;
 	struct tlv_header *tlvh;
+	struct tlv_bank_header *bh;
+	struct tlv_property *tlvp;
 	struct tlv_store *tlvs;
-	int empty, len = 0;
-	unsigned int crc;
+	const char *val;
+	char *next;
+	int empty, sorted, log, banks, parts, i;
+	int version = EEPROM_VERSION;
+	uint32_t crc;
+	void *data;
+	size_t size, end, frag, budget;
 
 	if (dev->size <= sizeof(*tlvh)) {
 		lerror("Storage is too small %zu/%zu", dev->size, sizeof(*tlvh));
 		return NULL;
 	}
 
+	val = sopt_find(opts, "format");
+	if (val && *val)
+		version = atoi(val);
+	if (version != EEPROM_VERSION && version != EEPROM_VERSION_V2) {
+		lerror("Unsupported storage format '%s'", val);
+		return NULL;
+	}
+
 	tlvh = dev->base;
+	if (storage_fetch(dev, 0, sizeof(*tlvh)))
+		return NULL;
 	if (!strncmp(tlvh->magic, EEPROM_MAGIC, sizeof(tlvh->magic)) &&
-	    tlvh->version == EEPROM_VERSION)
+	    ((tlvh->version & EEPROM_VERSION_MASK) == EEPROM_VERSION ||
+	     (tlvh->version & EEPROM_VERSION_MASK) == EEPROM_VERSION_V2))
 		goto done;
 
-	empty = 1;
-	while (len < sizeof(*tlvh)) {
-		if (((unsigned char *)dev->base)[len] != 0xFF) {
-			empty = 0;
-			break;
-		}
-		len++;
-	}
+	empty = bempty_data(dev->base, sizeof(*tlvh));
 
 	if (empty || force) {
 		if (force)
 			ldebug("Reinitialising non-empty storage");
 		memset(tlvh, 0, sizeof(*tlvh));
 		memcpy(tlvh->magic, EEPROM_MAGIC, sizeof(tlvh->magic));
-		tlvh->version = EEPROM_VERSION;
+		tlvh->version = version;
 	} else {
 		ldebug("Unknown storage signature");
 		return NULL;
 	}
 
 done:
-	crc = crc_32(dev->base + sizeof(*tlvh), ntohl(tlvh->len));
-	if (crc != ntohl(tlvh->crc)) {
-		lerror("Invalid storage crc\n");
+	log = !!(tlvh->version & EEPROM_FLAG_LOG);
+	banks = !!(tlvh->version & EEPROM_FLAG_BANKS);
+	parts = !!(tlvh->version & EEPROM_FLAG_PARTS);
+	if ((log || sopt_find(opts, "log")) + (banks || sopt_find(opts, "banks")) +
+	    (parts || sopt_find(opts, "part")) > 1) {
+		lerror("Log, bank and partition modes are exclusive");
 		return NULL;
 	}
 
-	tlvs = tlvs_init(dev->base + sizeof(*tlvh), dev->size - sizeof(*tlvh));
-	if (!tlvs)
+	if (!log && sopt_find(opts, "log")) {
+		if (tlvh->len) {
+			lerror("Log mode requires empty storage");
+			return NULL;
+		}
+		/* Log banks are told apart by their headers, start erased */
+		if (storage_fetch(dev, 0, dev->size))
+			return NULL;
+		memset(dev->base + sizeof(*tlvh), 0xFF, dev->size - sizeof(*tlvh));
+		tlvh->version |= EEPROM_FLAG_LOG;
+		log = 1;
+	}
+
+	if (!banks && sopt_find(opts, "banks")) {
+		if (tlvh->len) {
+			lerror("Bank mode requires empty storage");
+			return NULL;
+		}
+		if (dev->size / 2 <= sizeof(*bh)) {
+			lerror("Storage is too small for banks %zu/%zu",
+			       dev->size / 2, sizeof(*bh));
+			return NULL;
+		}
+		/* Empty first bank of generation 0, second one invalid */
+		if (storage_fetch(dev, 0, dev->size))
+			return NULL;
+		memset(dev->base + sizeof(*tlvh), 0xFF, dev->size - sizeof(*tlvh));
+		bh = dev->base;
+		bh->hdr.version |= EEPROM_FLAG_BANKS;
+		bh->hdr.len = 0;
+		bh->gen = 0;
+		bh->hdr.crc = htonl(crc32_update(0, &bh->gen, sizeof(bh->gen)));
+		banks = 1;
+	}
+
+	val = sopt_find(opts, "part");
+	if (!parts && val) {
+		if (tlvh->len) {
+			lerror("Partitions require empty storage");
+			return NULL;
+		}
+		if (firmux_tlv_parts_format(dev, val))
+			return NULL;
+		parts = 1;
+	}
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		perror("calloc() failed");
+		return NULL;
+	}
+	ctx->dev = dev;
+	ctx->parts[0].hdr = tlvh;
+	ctx->parts_cnt = 1;
+	ctx->reccrc = !!(tlvh->version & EEPROM_FLAG_RECCRC);
+
+	if (log) {
+		ctx->parts[0].tlvs = tlvs_init_log_paged(dev->base + sizeof(*tlvh),
+							 dev->size - sizeof(*tlvh),
+							 (tlvh->version & EEPROM_VERSION_MASK) == EEPROM_VERSION_V2 ?
+							 TLV_FORMAT_V2 : TLV_FORMAT_V1,
+							 dev->cache ? storage_fetch_addr : NULL, dev);
+		if (!ctx->parts[0].tlvs) {
+			lerror("Failed to initialize TLV log");
+			goto fail;
+		}
+		goto opened;
+	}
+
+	if (banks) {
+		tlvh = firmux_tlv_bank_open(ctx, dev, &crc);
+		if (!tlvh) {
+			lerror("Invalid storage crc in both banks");
+			goto fail;
+		}
+		ctx->parts[0].hdr = tlvh;
+		ctx->reccrc = !!(tlvh->version & EEPROM_FLAG_RECCRC);
+		data = ctx->banks[ctx->bank] + 1;
+		size = ctx->bank_size - sizeof(*bh);
+	} else {
+		data = dev->base + sizeof(*tlvh);
+		size = dev->size - sizeof(*tlvh);
+		if (parts) {
+			end = firmux_tlv_parts_open(ctx, dev);
+			if (!end)
+				goto fail;
+			data += sizeof(struct tlv_part_table);
+			size = end - sizeof(*tlvh) - sizeof(struct tlv_part_table);
+		}
+
+		/* Whole data is read by the crc check, fetch it at once */
+		if (!ctx->reccrc && ntohl(tlvh->len) <= size &&
+		    storage_fetch_addr(dev, data, ntohl(tlvh->len))) {
+			lerror("Failed to read storage");
+			goto fail;
+		}
+
+		/* Records are verified on access in record crc mode */
+		crc = ntohl(tlvh->crc);
+		if (ntohl(tlvh->len) > size ||
+		    (!ctx->reccrc && crc != crc_32(data, ntohl(tlvh->len)))) {
+			lerror("Invalid storage crc\n");
+			goto fail;
+		}
+	}
+
+	tlvs = tlvs_init_paged(data, size,
+			       (tlvh->version & EEPROM_VERSION_MASK) == EEPROM_VERSION_V2 ?
+			       TLV_FORMAT_V2 : TLV_FORMAT_V1,
+			       dev->cache ? storage_fetch_addr : NULL, dev);
+	if (!tlvs) {
 		lerror("Failed to initialize TLV store");
+		goto fail;
+	}
+	ctx->parts[0].tlvs = tlvs;
+
+	tlvs_crc_init(tlvs, crc, ntohl(tlvh->len));
+
+opened:
+	if (!ctx->reccrc && sopt_find(opts, "reccrc")) {
+		for (i = 0; i < ctx->parts_cnt; i++) {
+			if (tlvs_len(ctx->parts[i].tlvs)) {
+				lerror("Record crc mode requires empty storage");
+				goto fail;
+			}
+		}
+		/* Records of the run carry crc, the header flag waits for commit */
+		ctx->reccrc = 1;
+		ctx->set_reccrc = 1;
+	}
 
-	return tlvs;
+	if (log)
+		return ctx;
+	tlvh = ctx->parts[0].hdr;
+
+	for (tlvp = &tlv_properties[0]; tlvp->tlvp_name; tlvp++) {
+		if (tlvp->tlvp_reserve)
+			tlvs_reserve(firmux_tlv_route(ctx, tlvp->tlvp_id), tlvp->tlvp_id,
+				     tlvp->tlvp_reserve + (ctx->reccrc ? 2 : 0));
+	}
+
+	if (sopt_find(opts, "migrate") &&
+	    (tlvh->version & EEPROM_VERSION_MASK) != version)
+		ctx->set_version = version;
+
+	sorted = !!(tlvh->version & EEPROM_FLAG_SORTED);
+	for (i = 0; i < ctx->parts_cnt; i++)
+		tlvs_set_sorted(ctx->parts[i].tlvs, sorted);
+
+	val = sopt_find(opts, "sorted");
+	if (val && sorted != !!strcmp(val, "0"))
+		ctx->set_sorted = 1;
+
+	/* Changes compact once holes pass frag bytes, budget bytes moved each */
+	val = sopt_find(opts, "compact");
+	if (val && *val) {
+		frag = strtoul(val, &next, 0);
+		budget = *next == ':' ? strtoul(next + 1, NULL, 0) : 0;
+		for (i = 0; i < ctx->parts_cnt; i++)
+			tlvs_compact_policy(ctx->parts[i].tlvs, frag, budget);
+	}
+
+	return ctx;
+fail:
+	for (i = 0; i < ctx->parts_cnt; i++)
+		if (ctx->parts[i].tlvs)
+			tlvs_free(ctx->parts[i].tlvs);
+	free(ctx);
+	return NULL;
 }
 
 static struct storage_protocol firmux_tlv_model = {
@@ -743,6 +1884,8 @@ static struct storage_protocol firmux_tlv_model = {
 	.print = firmux_tlv_prop_print,
 	.store = firmux_tlv_prop_store,
 	.flush = firmux_tlv_flush,
+	.begin = firmux_tlv_begin,
+	.commit = firmux_tlv_commit,
 };
 
 static void __attribute__((constructor)) firmux_tlv_register(void)
@@ -37,6 +37,11 @@ enum tlv_code {
 	EEPROM_ATTR_MAC_16,
 	EEPROM_ATTR_MAC_LAST = EEPROM_ATTR_MAC_16,
 
+	/* Radio containers, value is a nested store of tlv_radio_code types */
+	EEPROM_ATTR_RADIO = 224,
+	EEPROM_ATTR_RADIO_FIRST = EEPROM_ATTR_RADIO,
+	EEPROM_ATTR_RADIO_LAST = EEPROM_ATTR_RADIO + 7,
+
 	/* Calibration data */
 	EEPROM_ATTR_XTAL_CAL_DATA = 240,
 	EEPROM_ATTR_RADIO_CAL_DATA,
@@ -45,12 +50,26 @@ enum tlv_code {
 	EEPROM_ATTR_EMPTY = 0xFF,
 };
 
+/* Types local to a radio container */
+enum tlv_radio_code {
+	EEPROM_RADIO_NONE,
+	EEPROM_RADIO_CAL_DATA,                  /* binary, compressed */
+	EEPROM_RADIO_BOARD_DATA,                /* binary, compressed */
+
+	/* Per band calibration data */
+	EEPROM_RADIO_CAL_DATA_2G = 16,
+	EEPROM_RADIO_CAL_DATA_5G,
+	EEPROM_RADIO_CAL_DATA_6G,
+};
+
 enum tlv_spec {
 	INPUT_SPEC_NONE,
 	INPUT_SPEC_TXT,
 	INPUT_SPEC_BIN,
 };
 
+struct tlv_store;
+
 struct __attribute__ ((__packed__)) tlv_header {
 	char magic[7];
 	uint8_t version;
@@ -58,12 +77,42 @@ struct __attribute__ ((__packed__)) tlv_header {
 	uint32_t len;
 };
 
+#define EEPROM_PARTS_MAX 4
+
+/* Partition of types first..last, starts with its own struct tlv_header */
+struct __attribute__ ((__packed__)) tlv_part {
+	uint8_t first;
+	uint8_t last;
+	uint16_t reserved;
+	uint32_t offset;
+	uint32_t size;
+};
+
+/* Follows the device header, crc covers the rest of the table */
+struct __attribute__ ((__packed__)) tlv_part_table {
+	uint32_t crc;
+	uint8_t count;
+	uint8_t reserved[3];
+	struct tlv_part part[EEPROM_PARTS_MAX];
+};
+
+/* Dual bank layout, crc covers the data and the generation */
+struct __attribute__ ((__packed__)) tlv_bank_header {
+	struct tlv_header hdr;
+	uint32_t gen;
+};
+
 struct tlv_property {
 	const char *tlvp_name;
-	enum tlv_code tlvp_id;
+	/* enum tlv_code, enum tlv_radio_code of container members */
+	uint8_t tlvp_id;
 	enum tlv_spec tlvp_spec;
 	ssize_t (*tlvp_parse)(void **data_out, void *data_in, size_t size_in);
 	ssize_t (*tlvp_format)(void **data_out, void *data_in, size_t size_in);
+	/* Optional, formats value split over continuation records */
+	ssize_t (*tlvp_format_chunks)(void **data_out, struct tlv_store *tlvs, enum tlv_code code);
+	/* Optional, value capacity kept for in place updates */
+	uint16_t tlvp_reserve;
 };
 
 struct tlv_group {
@@ -75,4 +124,13 @@ struct tlv_group {
 	ssize_t (*tlvg_format)(void **data_out, void *data_in, size_t size_in, char **param);
 };
 
+/* Records of ids first..last hold nested stores of member properties */
+struct tlv_container {
+	const char *tlvc_pattern;
+	enum tlv_code tlvc_id_first;
+	enum tlv_code tlvc_id_last;
+	/* Member ids are local to the container */
+	struct tlv_property *tlvc_props;
+};
+
 #endif /* __FIRMUX_TLV_H */
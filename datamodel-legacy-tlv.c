@@ -342,10 +342,12 @@ static int legacy_tlv_prop_print_all(void *sp)
 static int legacy_tlv_prop_print(void *sp, char *key, char *out)
 {
 	struct tlv_store *tlvs = (struct tlv_store *)sp;
+	struct tlv_iterator iter;
+	struct tlv_view view;
 	enum tlv_spec spec;
-	char buf[getpagesize()];
+	const unsigned char *buf;
 	char *ifname, *val = NULL;
-	size_t len;
+	ssize_t len;
 	int i, type;
 
 	if (!key)
@@ -354,13 +356,16 @@ static int legacy_tlv_prop_print(void *sp, char *key, char *out)
 	if (strncmp(key, "GENERIC_MAC_", 12) == 0) {
 		ifname = key + 12;
 
-		/* Iterate through all MAC address properties */
-		for (type = EEPROM_ATTR_MAC_FIRST; type <= EEPROM_ATTR_MAC_LAST; type++) {
-			len = tlvs_get(tlvs, type, sizeof(buf), buf);
-			if (len <= 6)
-				return -1;
+		/* Iterate through stored MAC address properties only */
+		tlvs_iter_init_range(&iter, tlvs, EEPROM_ATTR_MAC_FIRST, EEPROM_ATTR_MAC_LAST);
+		while (tlvs_iter_next(&iter) != NULL) {
+			view = iter.view;
+			if (view.len <= 6)
+				continue;
 
-			if (strcmp(buf + 6, ifname))
+			buf = view.data;
+			if (strlen(ifname) > view.len - 6 ||
+			    strncmp((const char *)buf + 6, ifname, view.len - 6))
 				continue;
 
 			spec = INPUT_SPEC_TXT;
@@ -371,9 +376,8 @@ static int legacy_tlv_prop_print(void *sp, char *key, char *out)
 				return -1;
 			}
 			sprintf(val, "%02X:%02X:%02X:%02X:%02X:%02X",
-				(unsigned char)buf[0], (unsigned char)buf[1],
-				(unsigned char)buf[2], (unsigned char)buf[3],
-				(unsigned char)buf[4], (unsigned char)buf[5]);
+				buf[0], buf[1], buf[2], buf[3], buf[4], buf[5]);
+			break;
 		}
 	} else {
 		for (i = 0; i < ARRAY_SIZE(tlv_code_list); i++) {
@@ -384,19 +388,20 @@ static int legacy_tlv_prop_print(void *sp, char *key, char *out)
 			}
 		}
 
-		len = tlvs_get(tlvs, type, sizeof(buf), buf);
-		if (len < 0)
+		if (tlvs_view(tlvs, type, &view))
 			return -1;
 
+		len = view.len;
 		if (spec == INPUT_SPEC_TXT) {
 			val = realloc(val, len + 1);
 			if (!val) {
 				perror("realloc() failed");
 				return -1;
 			}
-			strncpy(val, buf, len);
+			memcpy(val, view.data, len);
+			val[len] = '\0';
 		} else if (type == EEPROM_ATTR_RADIO_CALIBRATION_DATA) {
-			len = decompress_bin((void *)&val, buf, len);
+			len = decompress_bin((void *)&val, (void *)view.data, len);
 			if (len < 0) {
 				lerror("Failed to decompress caldata");
 				return -1;
@@ -407,7 +412,7 @@ static int legacy_tlv_prop_print(void *sp, char *key, char *out)
 				perror("realloc() failed");
 				return -1;
 			}
-			memcpy(val, buf, len);
+			memcpy(val, view.data, len);
 		}
 	}
 
@@ -445,7 +450,7 @@ static void legacy_tlv_free(void *sp)
 	tlvs_free((struct tlv_store *)sp);
 }
 
-static void *legacy_tlv_init(struct storage_device *dev, int force)
+static void *legacy_tlv_init(struct storage_device *dev, int force, const char *opts)
 {
 	struct eeprom_header *hdr;
 	struct tlv_store *tlvs;
@@ -457,17 +462,25 @@ static void *legacy_tlv_init(struct storage_device *dev, int force)
 	}
 
 	hdr = dev->base;
-	if (strncmp(hdr->magic, EEPROM_MAGIC, sizeof(hdr->magic)) ||
+	if (storage_fetch(dev, 0, sizeof(*hdr)) ||
+	    strncmp(hdr->magic, EEPROM_MAGIC, sizeof(hdr->magic)) ||
 	    ntohs(hdr->version) != EEPROM_VERSION)
 		return NULL;
 
+	if (ntohl(hdr->totallen) > dev->size - sizeof(*hdr) ||
+	    storage_fetch(dev, sizeof(*hdr), ntohl(hdr->totallen))) {
+		lerror("Invalid storage length\n");
+		return NULL;
+	}
+
 	crc = crc_32((unsigned char *)dev->base + sizeof(*hdr), ntohl(hdr->totallen));
 	if (crc != ntohl(hdr->crc32)) {
 		lerror("Invalid storage crc\n");
 		return NULL;
 	}
 
-	tlvs = tlvs_init(dev->base + sizeof(*hdr), dev->size - sizeof(*hdr));
+	tlvs = tlvs_init_paged(dev->base + sizeof(*hdr), dev->size - sizeof(*hdr), TLV_FORMAT_V1,
+			       dev->cache ? storage_fetch_addr : NULL, dev);
 	if (!tlvs)
 		lerror("Failed to initialize TLV store");
 
@@ -167,6 +167,11 @@ int tlvstore_import_params(void)
 	int fail = 0;
 
 	ldebug("Starting parameters import");
+	if (eeprom_begin(proto) < 0) {
+		lerror("Failed to start TLV import");
+		return 1;
+	}
+
 	while (pl) {
 		if (eeprom_import(proto, pl->key, pl->val) < 0) {
 			lerror("Failed to import '%s' value '%s'", pl->key, pl->val);
@@ -175,6 +180,11 @@ int tlvstore_import_params(void)
 		pl = pl->next;
 	}
 
+	if (eeprom_commit(proto) < 0) {
+		lerror("Failed to commit TLV import");
+		fail++;
+	}
+
 	if (fail)
 		lerror("Failed TLV import, %i failures", fail);
 
@@ -193,6 +203,9 @@ static void tlvstore_usage(void)
 			"  -F, --store-file <file-name>     Storage file path\n"
 			"  -S, --store-size <file-size>     Preferred storage file size\n"
 			"  -f, --force                      Force initialise storage\n"
+			"  -O, --store-options <opts>       Storage model options, comma separated\n"
+			"  -B, --backend <name>             Storage backend: mmap (default), file, mem, mtd\n"
+			"  -D, --device-options <opts>      Storage device options, comma separated\n"
 			"  -c, --compat                     Compatibility retrieve avilable params\n"
 			"  -g, --get                        Get specified keys or all keys when no specified\n"
 			"  -s, --set                        Set specified keys\n"
@@ -205,6 +218,9 @@ static struct option tlvstore_options[] =
 	{ "store-size",   1, 0, 'S' },
 	{ "store-file",   1, 0, 'F' },
 	{ "force",        0, 0, 'f' },
+	{ "store-options", 1, 0, 'O' },
+	{ "backend",      1, 0, 'B' },
+	{ "device-options", 1, 0, 'D' },
 	{ "compat",       0, 0, 'c' },
 	{ "get",          0, 0, 'g' },
 	{ "set",          0, 0, 's' },
@@ -219,8 +235,11 @@ int main(int argc, char *argv[])
 	char *store_file = TLVS_DEFAULT_FILE;
 	int store_size = TLVS_DEFAULT_SIZE;
 	int force = 0;
+	char *store_opts = NULL;
+	char *dev_opts = NULL;
+	char *backend = NULL;
 
-	while ((opt = getopt_long(argc, argv, "F:S:hfcgsl", tlvstore_options, &index)) != -1) {
+	while ((opt = getopt_long(argc, argv, "F:S:O:B:D:hfcgsl", tlvstore_options, &index)) != -1) {
 		switch (opt) {
 		case 'F':
 			store_file = strdup(optarg);
@@ -231,6 +250,15 @@ int main(int argc, char *argv[])
 		case 'f':
 			force = 1;
 			break;
+		case 'O':
+			store_opts = strdup(optarg);
+			break;
+		case 'B':
+			backend = strdup(optarg);
+			break;
+		case 'D':
+			dev_opts = strdup(optarg);
+			break;
 		case 'c':
 			compat = 1;
 			break;
@@ -250,13 +278,16 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (!store_file) {
+	/* Memory storage has no file */
+	if (!store_file && (!backend || strcmp(backend, "mem"))) {
 		fprintf(stderr, "Storage file not specified\n");
 		tlvstore_usage();
 		exit(EXIT_FAILURE);
 	}
 
-	dev = storage_open(store_file, store_size);
+	/* Reading never writes to the storage, nor syncs it */
+	dev = storage_open(backend, store_file, store_size,
+			   op == OP_GET || op == OP_LIST ? STORAGE_RDONLY : 0, dev_opts);
 	if (!dev) {
 		fprintf(stderr, "Failed to initialize '%s' storage file\n", store_file);
 		exit(EXIT_FAILURE);
@@ -264,9 +295,10 @@ int main(int argc, char *argv[])
 
 	ldebug("Opened storage memory file %s at %p, size: %zi", store_file, dev->base, dev->size);
 
-	proto = eeprom_init(dev, force);
+	proto = eeprom_init(dev, force, store_opts);
 	if (!proto) {
 		fprintf(stderr, "Unknown storage protocol for '%s'\n", store_file);
+		storage_discard(dev);
 		storage_close(dev);
 		exit(EXIT_FAILURE);
 	}
@@ -276,6 +308,7 @@ int main(int argc, char *argv[])
 	if (tlvstore_parse_params(argc - optind, &argv[optind])) {
 		tlvstore_usage();
 		eeprom_free(proto);
+		storage_discard(dev);
 		storage_close(dev);
 		exit(EXIT_FAILURE);
 	}
@@ -295,6 +328,9 @@ int main(int argc, char *argv[])
 
 	eeprom_free(proto);
 
+	/* Storage model option changes are kept without an operation */
+	if (op && ret)
+		storage_discard(dev);
 	storage_close(dev);
 
 	eeprom_unregister();
@@ -57,7 +57,8 @@ void eeprom_unregister(void)
 	proto_list = NULL;
 }
 
-struct storage_protocol *eeprom_init(struct storage_device *dev, int force)
+struct storage_protocol *eeprom_init(struct storage_device *dev, int force,
+				     const char *opts)
 {
 	struct proto_entry *entry;
 	struct storage_protocol *proto;
@@ -65,10 +66,10 @@ struct storage_protocol *eeprom_init(struct storage_device *dev, int force)
 	void *priv = NULL;
 
 	found = proto_default;
-	priv = found->init(dev, force);
+	priv = found->init(dev, force, opts);
 	if (!priv && !force) {
 		for (entry = proto_list; entry != NULL; entry = entry->next) {
-			priv = entry->proto->init(dev, 0);
+			priv = entry->proto->init(dev, 0, opts);
 			if (!priv)
 				continue;
 			found = entry->proto;
@@ -114,6 +115,30 @@ int eeprom_flush(struct storage_protocol *proto)
 	return proto->flush(proto->priv);
 }
 
+int eeprom_begin(struct storage_protocol *proto)
+{
+	if (!proto->begin)
+		return 1;
+
+	ldebug("Starting protocol transaction: %s", proto->name);
+	return proto->begin(proto->priv);
+}
+
+int eeprom_commit(struct storage_protocol *proto)
+{
+	int ret;
+
+	if (!proto->commit)
+		return 1;
+
+	ldebug("Committing protocol transaction: %s", proto->name);
+	ret = proto->commit(proto->priv);
+	if (ret < 0)
+		return ret;
+
+	return eeprom_flush(proto);
+}
+
 void eeprom_list(struct storage_protocol *proto)
 {
 	if (!proto->list)
@@ -0,0 +1,510 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "char.h"
+#include "crc.h"
+#include "datamodel-firmux-tlv.h"
+#include "protocol.h"
+#include "tlv.h"
+#include "utils.h"
+
+/*
+ * Benchmarks, all of them or the ones named on the command line. Device
+ * latency is emulated, so the numbers compare methods, not hardware.
+ */
+
+static double bench_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Store of cnt records of len bytes at the start of an empty image */
+static int bench_image(const char *file, size_t size, int cnt, int len)
+{
+	unsigned char *mem, val[256];
+	struct tlv_store *tlvs;
+	FILE *fp;
+	int i, ret;
+
+	mem = malloc(size);
+	if (!mem)
+		return -1;
+	memset(mem, 0xFF, size);
+	memset(val, 'v', sizeof(val));
+
+	tlvs = tlvs_init(mem, size);
+	for (i = 0; i < cnt; i++)
+		tlvs_set(tlvs, 1 + i, len, val);
+	tlvs_free(tlvs);
+
+	fp = fopen(file, "wb");
+	ret = fp && fwrite(mem, 1, size, fp) == size ? 0 : -1;
+	if (fp)
+		fclose(fp);
+	free(mem);
+	return ret;
+}
+
+/*
+ * Get of the last record from an I2C EEPROM at 400 kHz: whole device read
+ * up front against pages read on access, with and without read ahead.
+ */
+static void bench_paged(void)
+{
+	static const size_t sizes[] = { 16384, 65536 };
+	static const char *const modes[][2] = {
+		{ "whole", "ahead=0,i2c=400" },
+		{ "paged", "ahead=0,i2c=400" },
+		{ "ahead", "ahead=4,i2c=400" },
+	};
+	char file[] = "/tmp/tlvs-bench.XXXXXX";
+	struct storage_device *dev;
+	struct tlv_store *tlvs;
+	struct timespec start;
+	char val[64];
+	int fd, i, j;
+
+	fd = mkstemp(file);
+	if (fd == -1) {
+		perror("mkstemp() failed");
+		return;
+	}
+	close(fd);
+
+	printf("paged: get of the last of 60 records, 9 KiB used, i2c 400 kHz\n");
+	printf("  %-8s %-6s %6s %8s %12s %8s\n", "device", "mode", "reads", "bytes", "emulated ms", "wall ms");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (bench_image(file, sizes[i], 60, 150))
+			break;
+		for (j = 0; j < sizeof(modes) / sizeof(modes[0]); j++) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			dev = storage_open("file", file, 0, STORAGE_RDONLY, modes[j][1]);
+			if (!dev)
+				break;
+			if (j == 0)
+				storage_readahead(dev, 0, dev->size);
+			tlvs = tlvs_init_paged(dev->base, dev->size, TLV_FORMAT_V1,
+					       storage_fetch_addr, dev);
+			tlvs_get(tlvs, 60, sizeof(val), val);
+			tlvs_free(tlvs);
+			printf("  %-8zu %-6s %6lu %8lu %12.1f %8.1f\n", sizes[i], modes[j][0],
+			       dev->cache->stats.reads, dev->cache->stats.bytes_read,
+			       dev->cache->stats.delay_ns / 1e6, bench_ms(&start));
+			storage_close(dev);
+		}
+	}
+
+	unlink(file);
+}
+
+/* crc_32() with the kernel picked at startup against the byte table loop */
+static void bench_crc(void)
+{
+	static const size_t sizes[] = { 16, 256, 4096, 65536, 1 << 20, 16 << 20 };
+	struct timespec start;
+	unsigned char *buf;
+	volatile uint32_t sink;
+	size_t i, j, n, rounds;
+	uint32_t crc;
+	double table, fast;
+
+	buf = malloc(sizes[5]);
+	if (!buf)
+		return;
+	for (i = 0; i < sizes[5]; i++)
+		buf[i] = i * 31 + (i >> 8);
+
+	printf("crc: throughput, MB/s\n");
+	printf("  %-10s %10s %10s\n", "size", "table", "crc_32");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		/* About 64 MB per method */
+		rounds = (64 << 20) / sizes[i];
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (n = 0; n < rounds / 8 + 1; n++) {
+			crc = 0xFFFFFFFF;
+			for (j = 0; j < sizes[i]; j++)
+				crc = update_crc_32(crc, buf[j]);
+			sink = crc;
+		}
+		table = (rounds / 8 + 1) * sizes[i] / 1e3 / bench_ms(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (n = 0; n < rounds; n++)
+			sink = crc_32(buf, sizes[i]);
+		fast = rounds * sizes[i] / 1e3 / bench_ms(&start);
+
+		printf("  %-10zu %10.0f %10.0f\n", sizes[i], table, fast);
+	}
+	(void)sink;
+
+	free(buf);
+}
+
+/* Fills the store with records of 1 to 64 bytes, returns the last type */
+static int bench_fill(struct tlv_store *tlvs, unsigned char *val)
+{
+	int type;
+
+	for (type = 1; type < 0xF0; type++)
+		if (tlvs_set(tlvs, type, 1 + type % 64, val))
+			break;
+
+	return type - 1;
+}
+
+/* Lookup through the type index against a walk of the records */
+static void bench_index(void)
+{
+	static const size_t sizes[] = { 8192, 65536, 1 << 20 };
+	struct tlv_iterator iter;
+	struct tlv_store *tlvs;
+	struct timespec start;
+	unsigned char *mem, val[256];
+	double index, walk;
+	int i, n, last, type;
+
+	memset(val, 'v', sizeof(val));
+	printf("index: lookup of a record, ns\n");
+	printf("  %-10s %8s %10s %10s\n", "store", "records", "index", "walk");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		mem = malloc(sizes[i]);
+		if (!mem)
+			return;
+		memset(mem, 0xFF, sizes[i]);
+		tlvs = tlvs_init(mem, sizes[i]);
+		/* Records start after deleted padding, as in a used store */
+		tlvs_set(tlvs, 0xF0, sizes[i] / 2, mem + sizes[i] / 2);
+		last = bench_fill(tlvs, val);
+		tlvs_del(tlvs, 0xF0);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (n = 0; n < 100000; n++)
+			tlvs_get(tlvs, 1 + n % last, sizeof(val), (char *)val);
+		index = bench_ms(&start) * 1e6 / n;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (n = 0; n < 2000; n++) {
+			type = 1 + n % last;
+			tlvs_iter_init(&iter, tlvs);
+			while (tlvs_iter_next(&iter) && ((struct tlv_field *)iter.curr)->type != type)
+				;
+		}
+		walk = bench_ms(&start) * 1e6 / n;
+
+		printf("  %-10zu %8d %10.0f %10.0f\n", sizes[i], last, index, walk);
+		tlvs_free(tlvs);
+		free(mem);
+	}
+}
+
+/* Padding runs of a fragmented image, bspan_byte() against a byte loop */
+static void bench_span(void)
+{
+	static const size_t runs[] = { 64, 4096, 65536 };
+	size_t size = 1 << 20, i, j, off, len;
+	struct timespec start;
+	unsigned char *mem;
+	double bytes, word;
+
+	mem = malloc(size);
+	if (!mem)
+		return;
+
+	printf("span: padding runs in 1 MiB, MB/s\n");
+	printf("  %-10s %10s %10s\n", "run", "byte", "bspan");
+	for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+		/* Runs of padding (zero bytes) split by 16 byte records */
+		memset(mem, 0x00, size);
+		for (off = runs[i]; off + 16 < size; off += runs[i] + 16)
+			memset(mem + off, 'r', 16);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < 20; j++) {
+			for (off = 0; off < size; off += len + 1) {
+				for (len = 0; off + len < size && mem[off + len] == 0x00; len++)
+					;
+			}
+		}
+		bytes = 20.0 * size / 1e3 / bench_ms(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < 20; j++) {
+			for (off = 0; off < size; off += len + 1)
+				len = bspan_byte(mem + off, size - off, 0x00);
+		}
+		word = 20.0 * size / 1e3 / bench_ms(&start);
+
+		printf("  %-10zu %10.0f %10.0f\n", runs[i], bytes, word);
+	}
+
+	free(mem);
+}
+
+/*
+ * Fragmentation of a 2 KiB store by 10000 random length updates of four
+ * text fields among static ones, with and without reserved capacity.
+ */
+static void bench_reserve(void)
+{
+	static const uint8_t hot[] = { 2, 5, 8, 11 };
+	unsigned char mem[2048], val[32];
+	struct tlv_store *tlvs;
+	unsigned long frag_sum;
+	size_t frag_peak;
+	int reserve, sorted, i, n;
+
+	memset(val, 'x', sizeof(val));
+	printf("reserve: 10000 updates of 4 of 12 fields, fragmentation in bytes\n");
+	printf("  %-8s %-8s %8s %8s %8s %8s\n", "order", "reserve", "moves", "compact", "avg", "peak");
+	for (sorted = 0; sorted <= 1; sorted++) {
+		for (reserve = 0; reserve <= 1; reserve++) {
+			srand(1);
+			memset(mem, 0xFF, sizeof(mem));
+			tlvs = tlvs_init(mem, sizeof(mem));
+			tlvs_set_sorted(tlvs, sorted);
+			for (i = 0; i < sizeof(hot) && reserve; i++)
+				tlvs_reserve(tlvs, hot[i], sizeof(val));
+			for (i = 1; i <= 12; i++)
+				tlvs_set(tlvs, i, 8 + i, val);
+
+			frag_sum = frag_peak = 0;
+			for (n = 0; n < 10000; n++) {
+				tlvs_set(tlvs, hot[rand() % sizeof(hot)], 4 + rand() % (sizeof(val) - 4), val);
+				frag_sum += tlvs->frag;
+				if (tlvs->frag > frag_peak)
+					frag_peak = tlvs->frag;
+			}
+
+			printf("  %-8s %-8s %8u %8u %8lu %8zu\n", sorted ? "sorted" : "unsorted",
+			       reserve ? "yes" : "no", tlvs->stats.set_move, tlvs->stats.compact,
+			       frag_sum / n, frag_peak);
+			tlvs_free(tlvs);
+		}
+	}
+}
+
+/*
+ * Write amplification of 10000 random length updates of four fields in
+ * a 4 KiB store: bytes written to the storage per value byte stored, in
+ * place against the append-only log collected into its spare bank.
+ */
+static void bench_log(void)
+{
+	static const uint8_t hot[] = { 2, 5, 8, 11 };
+	unsigned char mem[4096], val[32];
+	struct tlv_store *tlvs;
+	int log, i, n;
+
+	memset(val, 'x', sizeof(val));
+	printf("log: 10000 updates of 4 of 12 fields in 4 KiB, write amplification\n");
+	printf("  %-8s %10s %10s %8s %8s %8s\n", "mode", "value", "written", "ampl", "compact", "erases");
+	for (log = 0; log <= 1; log++) {
+		srand(1);
+		memset(mem, 0xFF, sizeof(mem));
+		tlvs = log ? tlvs_init_log(mem, sizeof(mem), TLV_FORMAT_V1) :
+			     tlvs_init(mem, sizeof(mem));
+		for (i = 1; i <= 12; i++)
+			tlvs_set(tlvs, i, 8 + i, val);
+		memset(&tlvs->stats, 0, sizeof(tlvs->stats));
+
+		for (n = 0; n < 10000; n++)
+			tlvs_set(tlvs, hot[rand() % sizeof(hot)], 4 + rand() % (sizeof(val) - 4), val);
+
+		printf("  %-8s %10lu %10lu %8.2f %8u %8u\n", log ? "log" : "inplace",
+		       tlvs->stats.bytes_value, tlvs->stats.bytes_written,
+		       (double)tlvs->stats.bytes_written / tlvs->stats.bytes_value,
+		       tlvs->stats.compact, tlvs->stats.erase);
+		tlvs_free(tlvs);
+	}
+}
+
+static const struct storage_backend *file_ops;
+static struct storage_backend counted;
+static unsigned long writes, written;
+
+static ssize_t count_write(struct storage_device *dev, const void *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	ret = file_ops->write(dev, buf, len, off);
+	if (ret > 0) {
+		writes++;
+		written += ret;
+	}
+	return ret;
+}
+
+/*
+ * Commits of two short fields to an EEPROM of 32 byte write pages, in
+ * place against dual bank storage. Each commit is a separate open.
+ */
+static void bench_banks(void)
+{
+	static const char *const modes[][2] = {
+		{ "inplace", "" },
+		{ "banks", "banks" },
+	};
+	char file[] = "/tmp/tlvs-bench.XXXXXX";
+	char serial[16], rev[8];
+	struct storage_protocol *proto;
+	struct storage_device *dev;
+	struct timespec start;
+	int fd, i, n;
+
+	fd = mkstemp(file);
+	if (fd == -1) {
+		perror("mkstemp() failed");
+		return;
+	}
+	close(fd);
+
+	printf("banks: 100 commits of two short fields, 8 KiB device, 32 byte pages\n");
+	printf("  %-8s %12s %12s %12s\n", "mode", "writes", "bytes", "ms/commit");
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		if (truncate(file, 0))
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (n = 0; n < 100; n++) {
+			dev = storage_open("file", file, 8192, 0, "wpage=32,sync=none");
+			if (!dev)
+				break;
+			file_ops = dev->ops;
+			counted = *file_ops;
+			counted.write = count_write;
+			dev->ops = &counted;
+			proto = eeprom_init(dev, 0, (char *)modes[i][1]);
+			if (!proto) {
+				storage_close(dev);
+				break;
+			}
+			snprintf(serial, sizeof(serial), "SN%05d", n);
+			snprintf(rev, sizeof(rev), "%04d", n % 7);
+			eeprom_begin(proto);
+			eeprom_import(proto, "SERIAL_NO", serial);
+			eeprom_import(proto, "PCB_REVISION", rev);
+			eeprom_commit(proto);
+			eeprom_free(proto);
+			storage_close(dev);
+			/* Skips the first commit that formats the storage */
+			if (!n)
+				writes = written = 0;
+		}
+		printf("  %-8s %12.1f %12.1f %12.3f\n", modes[i][0], writes / 99.0,
+		       written / 99.0, bench_ms(&start) / 100);
+	}
+
+	unlink(file);
+}
+
+/* Values of a firmux-tlv store as written in production */
+static const struct {
+	uint8_t type;
+	uint16_t len;
+} format_mix[] = {
+	{ EEPROM_ATTR_PRODUCT_ID, 5 },
+	{ EEPROM_ATTR_PRODUCT_NAME, 14 },
+	{ EEPROM_ATTR_SERIAL_NO, 12 },
+	{ EEPROM_ATTR_PCB_NAME, 9 },
+	{ EEPROM_ATTR_PCB_REVISION, 4 },
+	{ EEPROM_ATTR_PCB_PRDATE, 3 },
+	{ EEPROM_ATTR_PCB_PRLOCATION, 6 },
+	{ EEPROM_ATTR_PCB_SN, 12 },
+	{ EEPROM_ATTR_MAC_1, 6 },
+	{ EEPROM_ATTR_MAC_2, 6 },
+	{ EEPROM_ATTR_MAC_3, 6 },
+	{ EEPROM_ATTR_MAC_4, 6 },
+	{ EEPROM_ATTR_XTAL_CAL_DATA, 2 },
+	/* Compressed radio calibration */
+	{ EEPROM_ATTR_RADIO_CAL_DATA, 1210 },
+	{ EEPROM_ATTR_RADIO_BOARD_DATA, 380 },
+};
+
+static size_t format_fill(unsigned char *mem, size_t size, int format, int cnt)
+{
+	unsigned char val[2048];
+	struct tlv_store *tlvs;
+	size_t len;
+	int i;
+
+	memset(val, 'x', sizeof(val));
+	memset(mem, 0xFF, size);
+	tlvs = tlvs_init_format(mem, size, format);
+	for (i = 0; i < cnt; i++)
+		tlvs_set(tlvs, format_mix[i].type, format_mix[i].len, val);
+	len = tlvs_len(tlvs);
+	tlvs_free(tlvs);
+	return len;
+}
+
+static void bench_format(void)
+{
+	/* Identity records only, and with the radio calibration */
+	static const struct {
+		const char *name;
+		int cnt;
+	} mixes[] = {
+		{ "ids", 13 },
+		{ "calib", sizeof(format_mix) / sizeof(format_mix[0]) },
+	};
+	static unsigned char mem[4096], direct[4096];
+	struct tlv_store *tlvs;
+	size_t v1, v2;
+	int high, i, j;
+
+	printf("format: bytes used by the firmux field mix, v1 migrated to v2\n");
+	printf("  %-8s %8s %8s %8s %8s %8s %8s\n", "mix", "records", "v1", "v2", "saved",
+	       "migrate", "vtype");
+	for (i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++) {
+		v2 = format_fill(direct, sizeof(direct), TLV_FORMAT_V2, mixes[i].cnt);
+		v1 = format_fill(mem, sizeof(mem), TLV_FORMAT_V1, mixes[i].cnt);
+
+		tlvs = tlvs_init_format(mem, sizeof(mem), TLV_FORMAT_V1);
+		tlvs_convert(tlvs, TLV_FORMAT_V2);
+		tlvs_free(tlvs);
+
+		/* Varint types would take a second byte for codes from 128 */
+		for (j = high = 0; j < mixes[i].cnt; j++)
+			high += format_mix[j].type >= 0x80;
+
+		printf("  %-8s %8d %8zu %8zu %7.1f%% %8s %8zu\n", mixes[i].name, mixes[i].cnt,
+		       v1, v2, 100.0 * (v1 - v2) / v1,
+		       memcmp(mem, direct, sizeof(mem)) ? "differs" : "same", v2 + high);
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} benches[] = {
+	{ "crc", bench_crc },
+	{ "index", bench_index },
+	{ "span", bench_span },
+	{ "reserve", bench_reserve },
+	{ "log", bench_log },
+	{ "banks", bench_banks },
+	{ "paged", bench_paged },
+	{ "format", bench_format },
+};
+
+int main(int argc, char *argv[])
+{
+	int i, j;
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		for (j = 1; j < argc; j++)
+			if (!strcmp(argv[j], benches[i].name))
+				break;
+		if (argc > 1 && j == argc)
+			continue;
+		benches[i].run();
+	}
+
+	return 0;
+}
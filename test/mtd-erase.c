@@ -0,0 +1,121 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "char.h"
+
+/*
+ * Erase block write back of the mtd backend over a device image. Changed
+ * blocks must be read, erased and written whole, runs of them in one
+ * erase and one write, the rest of the image left untouched.
+ */
+
+#define BLOCK 4096
+#define BLOCKS 6
+
+static const struct storage_backend *mtd_ops;
+static struct storage_backend counted;
+static unsigned long erases, erased, writes, written;
+
+static int count_erase(struct storage_device *dev, off_t off, size_t len)
+{
+	erases++;
+	erased += len;
+	return mtd_ops->erase(dev, off, len);
+}
+
+static ssize_t count_write(struct storage_device *dev, const void *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	ret = mtd_ops->write(dev, buf, len, off);
+	if (ret > 0) {
+		writes++;
+		written += ret;
+	}
+	return ret;
+}
+
+static unsigned char image[BLOCK * BLOCKS];
+
+/* Changes bytes at the given offsets, -1 terminated, a byte keeps its value when equal is set */
+static int erase_case(const char *name, const char *file, const int *offs, int equal,
+		      unsigned long exp_erases, unsigned long exp_erased)
+{
+	unsigned char data[sizeof(image)];
+	struct storage_device *dev;
+	unsigned char *base;
+	int i, fd;
+
+	dev = storage_open("mtd", file, 0, 0, "erase=4096,sync=none");
+	if (!dev)
+		return -1;
+
+	mtd_ops = dev->ops;
+	counted = *mtd_ops;
+	counted.erase = count_erase;
+	counted.write = count_write;
+	dev->ops = &counted;
+	erases = erased = writes = written = 0;
+
+	base = dev->base;
+	for (i = 0; offs[i] >= 0; i++) {
+		if (!equal)
+			image[offs[i]] ^= 0x5A;
+		if (storage_fetch(dev, offs[i], 1))
+			return -1;
+		base[offs[i]] = image[offs[i]];
+	}
+	storage_close(dev);
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1 || pread(fd, data, sizeof(data), 0) != sizeof(data)) {
+		perror("mtd-erase: read image");
+		return -1;
+	}
+	close(fd);
+
+	if (erases != exp_erases || erased != exp_erased ||
+	    writes != exp_erases || written != exp_erased || memcmp(data, image, sizeof(image))) {
+		fprintf(stderr, "mtd-erase: %s: %lu erases %lu bytes, %lu writes %lu bytes%s, "
+			"expected %lu erases %lu bytes\n", name, erases, erased, writes, written,
+			memcmp(data, image, sizeof(image)) ? ", image differs" : "",
+			exp_erases, exp_erased);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	static const int none[] = { 100, 5000, -1 };
+	static const int one[] = { BLOCK + 17, -1 };
+	static const int run[] = { 2 * BLOCK + 1, 3 * BLOCK + 9, 2 * BLOCK + 4095, -1 };
+	static const int apart[] = { 0, 4 * BLOCK + 77, -1 };
+	static const int last[] = { BLOCKS * BLOCK - 1, -1 };
+	char file[] = "/tmp/tlvs-mtd.XXXXXX";
+	int i, fd, fail = 0;
+
+	for (i = 0; i < sizeof(image); i++)
+		image[i] = i * 7 + i / 256;
+
+	fd = mkstemp(file);
+	if (fd == -1 || write(fd, image, sizeof(image)) != sizeof(image)) {
+		perror("mtd-erase: create image");
+		return 1;
+	}
+	close(fd);
+
+	fail |= erase_case("unchanged", file, none, 1, 0, 0);
+	fail |= erase_case("one block", file, one, 0, 1, BLOCK);
+	fail |= erase_case("block run", file, run, 0, 1, 2 * BLOCK);
+	fail |= erase_case("apart", file, apart, 0, 2, 2 * BLOCK);
+	fail |= erase_case("last", file, last, 0, 1, BLOCK);
+	unlink(file);
+
+	printf("mtd-erase: %s\n", fail ? "FAIL" : "ok");
+	return fail ? 1 : 0;
+}
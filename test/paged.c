@@ -0,0 +1,255 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "char.h"
+#include "tlv.h"
+
+/*
+ * Paged storage over an image file: storage_fetch() reads only absent
+ * pages, sequential fetches grow the read ahead window, several paged
+ * devices are open at once, system calls see fetched pages and only
+ * changed pages are written back. A store over a paged device reads
+ * record headers on open and values on access.
+ */
+
+#define IMAGE_SIZE (64 * 1024)
+#define RECORDS 40
+#define RECORD_LEN 1000
+
+static unsigned char image[IMAGE_SIZE];
+static unsigned char copy[IMAGE_SIZE];
+
+static int expect(struct storage_device *dev, const char *what,
+		  unsigned long reads, unsigned long bytes)
+{
+	if (dev->cache->stats.reads == reads && dev->cache->stats.bytes_read == bytes)
+		return 0;
+
+	fprintf(stderr, "paged: %s: %lu transfers %lu bytes, %lu %lu expected\n", what,
+		dev->cache->stats.reads, dev->cache->stats.bytes_read, reads, bytes);
+	return -1;
+}
+
+static int write_image(const char *file, const void *data, size_t len)
+{
+	int fd, ret;
+
+	fd = open(file, O_WRONLY | O_TRUNC);
+	ret = fd != -1 && write(fd, data, len) == len ? 0 : -1;
+	if (fd != -1)
+		close(fd);
+	return ret;
+}
+
+static int read_image(const char *file, void *data, size_t len)
+{
+	int fd, ret;
+
+	fd = open(file, O_RDONLY);
+	ret = fd != -1 && pread(fd, data, len, 0) == len ? 0 : -1;
+	if (fd != -1)
+		close(fd);
+	return ret;
+}
+
+static int fetch_run(const char *file, int sink)
+{
+	struct storage_device *dev, *seq;
+	unsigned char *base;
+	size_t page;
+	int fail = 0;
+
+	dev = storage_open("file", file, 0, STORAGE_RDONLY, "ahead=0");
+	seq = storage_open("file", file, 0, STORAGE_RDONLY, "paged,ahead=4");
+	if (!dev || !seq) {
+		fprintf(stderr, "paged: open of two devices failed\n");
+		if (dev)
+			storage_close(dev);
+		return -1;
+	}
+	base = dev->base;
+	page = dev->cache->page;
+
+	fail |= expect(dev, "open", 0, 0);
+	if (storage_fetch(dev, page + 1, 1) || base[page + 1] != image[page + 1])
+		fail = 1;
+	fail |= expect(dev, "fetch", 1, page);
+	storage_fetch(dev, page, page);
+	fail |= expect(dev, "fetch of cached page", 1, page);
+
+	/* Absent run is one transfer, cached pages are skipped */
+	storage_fetch(dev, 0, 4 * page);
+	fail |= expect(dev, "fetch around cached page", 3, 4 * page);
+	if (storage_fetch(dev, IMAGE_SIZE - 1, 2) != -1) {
+		fprintf(stderr, "paged: fetch past the end succeeded\n");
+		fail = 1;
+	}
+
+	/* Fetched pages are plain memory to system calls */
+	if (pwrite(sink, base, 4 * page, 0) != 4 * page ||
+	    pread(sink, copy, 4 * page, 0) != 4 * page || memcmp(copy, image, 4 * page)) {
+		fprintf(stderr, "paged: write of fetched pages failed\n");
+		fail = 1;
+	}
+
+	/* Window doubles on each fetch at the page following the last read */
+	storage_fetch(seq, 0, 1);
+	storage_fetch(seq, page, 1);
+	storage_fetch(seq, 3 * page, 1);
+	storage_fetch(seq, 6 * page, 1);
+	fail |= expect(seq, "sequential fetches", 4, 11 * page);
+	storage_fetch(seq, 20 * page, 1);
+	fail |= expect(seq, "random fetch", 5, 12 * page);
+	if (memcmp(seq->base, image, 11 * page) || memcmp(seq->base + 20 * page, image + 20 * page, page)) {
+		fprintf(stderr, "paged: fetched pages differ from the image\n");
+		fail = 1;
+	}
+
+	storage_close(seq);
+	storage_close(dev);
+	return fail ? -1 : 0;
+}
+
+static const struct storage_backend *file_ops;
+static struct storage_backend counted;
+static unsigned long writes, written;
+
+static ssize_t count_write(struct storage_device *dev, const void *buf, size_t len, off_t off)
+{
+	writes++;
+	written += len;
+	return file_ops->write(dev, buf, len, off);
+}
+
+/* Changes a byte of each listed page, back to its value when restore is set */
+static int writeback_case(const char *file, const int *pages, int restore,
+			  unsigned long exp_writes)
+{
+	struct storage_device *dev;
+	unsigned char *base;
+	size_t page, off;
+	int i;
+
+	dev = storage_open("file", file, 0, 0, "paged,ahead=0,sync=none");
+	if (!dev)
+		return -1;
+	file_ops = dev->ops;
+	counted = *file_ops;
+	counted.write = count_write;
+	dev->ops = &counted;
+	writes = written = 0;
+	base = dev->base;
+	page = dev->cache->page;
+
+	storage_fetch(dev, 0, 8 * page);
+	for (i = 0; pages[i] >= 0; i++) {
+		off = pages[i] * page + 7;
+		base[off] ^= 0x5A;
+		if (restore)
+			base[off] ^= 0x5A;
+		else
+			image[off] ^= 0x5A;
+	}
+	storage_close(dev);
+
+	if (writes != exp_writes || written != exp_writes * page ||
+	    read_image(file, copy, sizeof(copy)) || memcmp(copy, image, sizeof(image))) {
+		fprintf(stderr, "paged: %lu writes %lu bytes, %lu pages expected\n",
+			writes, written, exp_writes);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int writeback_run(const char *file)
+{
+	static const int one[] = { 3, -1 };
+	static const int apart[] = { 1, 5, -1 };
+	int fail = 0;
+
+	fail |= writeback_case(file, one, 0, 1);
+	fail |= writeback_case(file, apart, 0, 2);
+	/* Read pages changed back to their contents are not written */
+	fail |= writeback_case(file, apart, 1, 0);
+
+	return fail ? -1 : 0;
+}
+
+static int store_run(const char *file)
+{
+	static unsigned char mem[IMAGE_SIZE];
+	struct storage_device *dev;
+	struct tlv_store *tlvs;
+	unsigned char val[RECORD_LEN], got[RECORD_LEN];
+	unsigned long bytes;
+	int i, fail = 0;
+
+	memset(mem, 0xFF, sizeof(mem));
+	tlvs = tlvs_init(mem, sizeof(mem));
+	for (i = 0; i < RECORDS; i++) {
+		memset(val, i, sizeof(val));
+		tlvs_set(tlvs, 1 + i, sizeof(val), val);
+	}
+	tlvs_free(tlvs);
+	if (write_image(file, mem, sizeof(mem)))
+		return -1;
+
+	dev = storage_open("file", file, 0, STORAGE_RDONLY, "page=64,ahead=0");
+	if (!dev)
+		return -1;
+
+	/* Pages of the record headers only, at most two each */
+	tlvs = tlvs_init_paged(dev->base, dev->size, TLV_FORMAT_V1, storage_fetch_addr, dev);
+	if (!tlvs || dev->cache->stats.bytes_read > 2 * RECORDS * 64) {
+		fprintf(stderr, "paged: store open read %lu bytes\n", dev->cache->stats.bytes_read);
+		if (tlvs)
+			tlvs_free(tlvs);
+		storage_close(dev);
+		return -1;
+	}
+
+	bytes = dev->cache->stats.bytes_read;
+	memset(val, RECORDS / 2, sizeof(val));
+	if (tlvs_get(tlvs, 1 + RECORDS / 2, sizeof(got), (char *)got) != sizeof(got) ||
+	    memcmp(got, val, sizeof(got)) || dev->cache->stats.bytes_read - bytes > sizeof(got) + 2 * 64) {
+		fprintf(stderr, "paged: get read %lu bytes\n", dev->cache->stats.bytes_read - bytes);
+		fail = 1;
+	}
+
+	tlvs_free(tlvs);
+	storage_close(dev);
+	return fail ? -1 : 0;
+}
+
+int main(void)
+{
+	char file[] = "/tmp/tlvs-paged.XXXXXX";
+	char out[] = "/tmp/tlvs-paged-out.XXXXXX";
+	int i, fd, sink, fail = 0;
+
+	for (i = 0; i < sizeof(image); i++)
+		image[i] = i * 13 + i / 512;
+
+	fd = mkstemp(file);
+	sink = mkstemp(out);
+	if (fd == -1 || sink == -1 || write(fd, image, sizeof(image)) != sizeof(image)) {
+		perror("paged: create image");
+		return 1;
+	}
+	close(fd);
+
+	fail |= fetch_run(file, sink);
+	fail |= writeback_run(file);
+	fail |= store_run(file);
+
+	close(sink);
+	unlink(out);
+	unlink(file);
+
+	printf("paged: %s\n", fail ? "FAIL" : "ok");
+	return fail ? 1 : 0;
+}
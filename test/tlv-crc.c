@@ -0,0 +1,84 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc.h"
+#include "tlv.h"
+
+/*
+ * Random set, delete and grow sequences, the incremental storage crc must
+ * match crc_32() of the used area after every operation.
+ */
+
+#define STORE_SIZE 8192
+#define STEPS 20000
+
+static int crc_run(int format, int sorted, unsigned int seed)
+{
+	static unsigned char mem[STORE_SIZE];
+	unsigned char val[3000];
+	struct tlv_store *tlvs;
+	uint8_t type;
+	ssize_t got;
+	size_t len;
+	int i, op;
+
+	srand(seed);
+	memset(mem, 0xFF, sizeof(mem));
+	tlvs = tlvs_init_format(mem, sizeof(mem), format);
+	if (!tlvs)
+		return -1;
+	tlvs_set_sorted(tlvs, sorted);
+	tlvs_crc_init(tlvs, 0, 0);
+
+	for (i = 0; i < STEPS; i++) {
+		type = 1 + rand() % 48;
+		op = rand() % 16;
+		len = rand() % 200;
+		memset(val, rand(), sizeof(val));
+
+		if (op < 8) {
+			tlvs_set(tlvs, type, len, val);
+		} else if (op < 10) {
+			/* Grow by a few bytes, mostly in place */
+			got = tlvs_get(tlvs, type, sizeof(val), (char *)val);
+			if (got >= 0 && got < 200)
+				tlvs_set(tlvs, type, got + 1 + rand() % 8, val);
+		} else if (op < 13) {
+			tlvs_del(tlvs, type);
+		} else if (op == 13) {
+			tlvs_set_large(tlvs, type, 500 + rand() % 2500, val);
+		} else if (op == 14) {
+			tlvs_begin(tlvs);
+			tlvs_set(tlvs, type, len, val);
+			tlvs_del(tlvs, 1 + rand() % 48);
+			tlvs_set(tlvs, 1 + rand() % 48, rand() % 100, val);
+			tlvs_commit(tlvs);
+		} else {
+			tlvs_optimise_step(tlvs, rand() % 256);
+		}
+
+		if (tlvs_crc(tlvs) != crc_32(mem, tlvs_len(tlvs))) {
+			fprintf(stderr, "tlv-crc: format %d sorted %d seed %u: mismatch at step %d\n",
+				format, sorted, seed, i);
+			tlvs_free(tlvs);
+			return -1;
+		}
+	}
+
+	tlvs_free(tlvs);
+	return 0;
+}
+
+int main(void)
+{
+	int format, sorted, fail = 0;
+
+	for (format = TLV_FORMAT_V1; format <= TLV_FORMAT_V2; format++)
+		for (sorted = 0; sorted <= 1; sorted++)
+			fail |= crc_run(format, sorted, format * 2 + sorted);
+
+	printf("tlv-crc: %s\n", fail ? "FAIL" : "ok");
+	return fail ? 1 : 0;
+}
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tlv.h"
+
+/*
+ * Walk by a random type map must return the same records as the full
+ * walk filtered by the map, in type order, with changes staged by an
+ * open transaction seen the same as tlvs_get() sees them.
+ */
+
+#define STORE_SIZE 1024
+#define STEPS 200
+
+static int iter_check(struct tlv_store *tlvs, const uint8_t *types, const char *what)
+{
+	struct tlv_iterator iter;
+	struct tlv_field *tlv;
+	unsigned char got[256];
+	int type, prev = -1, seen = 0, want = 0;
+	ssize_t len;
+
+	tlvs_iter_init_types(&iter, tlvs, types);
+	while ((tlv = tlvs_iter_next(&iter)) != NULL) {
+		type = tlv->type;
+		len = tlvs_get(tlvs, type, sizeof(got), (char *)got);
+		if (!(types[type / 8] & 1 << type % 8) || type <= prev ||
+		    len != (ssize_t)iter.view.len || memcmp(got, iter.view.data, len)) {
+			fprintf(stderr, "tlv-iter: %s: type %d out of the map, order or value\n",
+				what, type);
+			return -1;
+		}
+		prev = type;
+		seen++;
+	}
+
+	for (type = 1; type < TLV_TYPES - 2; type++)
+		if ((types[type / 8] & 1 << type % 8) && tlvs_size(tlvs, type) >= 0)
+			want++;
+
+	if (seen != want) {
+		fprintf(stderr, "tlv-iter: %s: %d records visited, %d expected\n", what, seen, want);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int iter_run(unsigned int seed)
+{
+	static unsigned char mem[STORE_SIZE];
+	uint8_t types[TLV_TYPES / 8];
+	unsigned char val[64];
+	struct tlv_store *tlvs;
+	int i, n, type, fail = 0;
+
+	srand(seed);
+	memset(mem, 0xFF, sizeof(mem));
+	tlvs = tlvs_init(mem, sizeof(mem));
+
+	for (i = 0; i < STEPS && !fail; i++) {
+		/* Sparse maps leave whole bytes empty */
+		memset(types, 0, sizeof(types));
+		for (n = rand() % 8; n > 0; n--) {
+			type = 1 + rand() % 64;
+			types[type / 8] |= 1 << type % 8;
+		}
+
+		type = 1 + rand() % 64;
+		memset(val, rand(), sizeof(val));
+		if (rand() % 4)
+			tlvs_set(tlvs, type, rand() % sizeof(val), val);
+		else
+			tlvs_del(tlvs, type);
+		fail |= iter_check(tlvs, types, "store");
+
+		if (i % 10)
+			continue;
+
+		tlvs_begin(tlvs);
+		tlvs_set(tlvs, 1 + rand() % 64, rand() % sizeof(val), val);
+		tlvs_del(tlvs, 1 + rand() % 64);
+		fail |= iter_check(tlvs, types, "transaction");
+		if (rand() % 2)
+			tlvs_commit(tlvs);
+		else
+			tlvs_abort(tlvs);
+		fail |= iter_check(tlvs, types, "after transaction");
+	}
+
+	tlvs_free(tlvs);
+	return fail ? -1 : 0;
+}
+
+int main(void)
+{
+	unsigned int seed;
+	int fail = 0;
+
+	for (seed = 1; seed <= 20; seed++)
+		fail |= iter_run(seed);
+
+	printf("tlv-iter: %s\n", fail ? "FAIL" : "ok");
+	return fail ? 1 : 0;
+}
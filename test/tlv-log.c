@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tlv.h"
+
+/*
+ * Random updates of a log store, collected into the spare bank many
+ * times over, must read back the same as a plain copy of the values,
+ * both from the open store and from the storage opened again. A torn
+ * last append reads as the previous value and a corrupted length ends
+ * the log at the record before it.
+ */
+
+#define STORE_SIZE 1024
+#define STEPS 2000
+#define TYPES 10
+#define HDR_LEN 3	/* TLV_FORMAT_V1 record header */
+
+static unsigned char mem[STORE_SIZE];
+static unsigned char values[TYPES + 1][64];
+static int lengths[TYPES + 1];
+
+static int log_check(struct tlv_store *tlvs, const char *what, unsigned int seed, int step)
+{
+	unsigned char got[64];
+	ssize_t len;
+	int type;
+
+	for (type = 1; type <= TYPES; type++) {
+		len = tlvs_get(tlvs, type, sizeof(got), (char *)got);
+		if (len != lengths[type] || (len > 0 && memcmp(got, values[type], len))) {
+			fprintf(stderr, "tlv-log: %s: seed %u: type %d differs at step %d\n",
+				what, seed, type, step);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int log_run(unsigned int seed)
+{
+	struct tlv_store *tlvs, *again;
+	unsigned char val[64];
+	int i, type, len, fail = 0;
+
+	srand(seed);
+	memset(mem, 0xFF, sizeof(mem));
+	for (type = 1; type <= TYPES; type++)
+		lengths[type] = -1;
+	tlvs = tlvs_init_log(mem, sizeof(mem), TLV_FORMAT_V1);
+
+	for (i = 0; i < STEPS && !fail; i++) {
+		type = 1 + rand() % TYPES;
+		if (rand() % 8 == 0) {
+			if (!tlvs_del(tlvs, type))
+				lengths[type] = -1;
+		} else {
+			len = rand() % sizeof(val);
+			memset(val, rand(), len);
+			/* Full log keeps the current value */
+			if (!tlvs_set(tlvs, type, len, val)) {
+				memcpy(values[type], val, len);
+				lengths[type] = len;
+			}
+		}
+		fail |= log_check(tlvs, "store", seed, i);
+
+		if (i % 50)
+			continue;
+		again = tlvs_init_log(mem, sizeof(mem), TLV_FORMAT_V1);
+		fail |= !again || log_check(again, "reopen", seed, i);
+		if (again)
+			tlvs_free(again);
+	}
+
+	if (!fail && !tlvs->stats.compact) {
+		fprintf(stderr, "tlv-log: seed %u: log never collected\n", seed);
+		fail = 1;
+	}
+
+	tlvs_free(tlvs);
+	return fail ? -1 : 0;
+}
+
+static int torn_run(void)
+{
+	struct tlv_store *tlvs;
+	unsigned char *rec;
+	int type, fail = 0;
+
+	memset(mem, 0xFF, sizeof(mem));
+	for (type = 1; type <= TYPES; type++)
+		lengths[type] = -1;
+	tlvs = tlvs_init_log(mem, sizeof(mem), TLV_FORMAT_V1);
+	memcpy(values[1], "first", 5);
+	lengths[1] = 5;
+	memcpy(values[2], "kept", 4);
+	lengths[2] = 4;
+	tlvs_set(tlvs, 1, 5, "first");
+	tlvs_set(tlvs, 2, 4, "kept");
+	tlvs_set(tlvs, 1, 6, "second");
+
+	/* Append cut before its crc was written */
+	rec = tlvs->base + tlvs->index[1];
+	memset(rec + HDR_LEN + 6, 0xFF, 2);
+	tlvs_free(tlvs);
+
+	tlvs = tlvs_init_log(mem, sizeof(mem), TLV_FORMAT_V1);
+	fail |= log_check(tlvs, "torn append", 0, 0);
+
+	/* Next append takes the place of the torn one */
+	memcpy(values[1], "third", 5);
+	tlvs_set(tlvs, 1, 5, "third");
+	tlvs_free(tlvs);
+	tlvs = tlvs_init_log(mem, sizeof(mem), TLV_FORMAT_V1);
+	fail |= log_check(tlvs, "append after torn", 0, 0);
+
+	/* Length past the bank */
+	rec = tlvs->base + tlvs->index[1];
+	rec[1] = 0x7F;
+	tlvs_free(tlvs);
+	tlvs = tlvs_init_log(mem, sizeof(mem), TLV_FORMAT_V1);
+	memcpy(values[1], "first", 5);
+	fail |= log_check(tlvs, "corrupted length", 0, 0);
+	tlvs_free(tlvs);
+
+	return fail ? -1 : 0;
+}
+
+int main(void)
+{
+	unsigned int seed;
+	int fail = 0;
+
+	for (seed = 1; seed <= 20; seed++)
+		fail |= log_run(seed);
+	fail |= torn_run();
+
+	printf("tlv-log: %s\n", fail ? "FAIL" : "ok");
+	return fail ? 1 : 0;
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tlv.h"
+
+/*
+ * Same random updates on a store with reservations and on one without,
+ * every update that fits the plain store must fit the reserved one and
+ * both must read back the same values. Rewriting a nearly full reserved
+ * store sorted or in another format must keep every record.
+ */
+
+#define STORE_SIZE 512
+#define STEPS 3000
+#define TYPES 12
+
+static int reserve_run(int sorted, unsigned int seed)
+{
+	static unsigned char mem_res[STORE_SIZE], mem_plain[STORE_SIZE];
+	unsigned char val[128], got_res[128], got_plain[128];
+	struct tlv_store *res, *plain;
+	ssize_t len_res, len_plain;
+	int i, type, len, ret_res, ret_plain, fail = 0;
+
+	srand(seed);
+	memset(mem_res, 0xFF, sizeof(mem_res));
+	memset(mem_plain, 0xFF, sizeof(mem_plain));
+	res = tlvs_init(mem_res, sizeof(mem_res));
+	plain = tlvs_init(mem_plain, sizeof(mem_plain));
+	tlvs_set_sorted(res, sorted);
+	tlvs_set_sorted(plain, sorted);
+	for (type = 1; type <= TYPES / 2; type++)
+		tlvs_reserve(res, type, 20 + type * 5);
+
+	for (i = 0; i < STEPS && !fail; i++) {
+		type = 1 + rand() % TYPES;
+		len = rand() % (rand() % 5 ? 40 : 120);
+		memset(val, rand(), len);
+
+		if (rand() % 10 == 0) {
+			tlvs_del(res, type);
+			tlvs_del(plain, type);
+			continue;
+		}
+
+		ret_res = tlvs_set(res, type, len, val);
+		ret_plain = tlvs_set(plain, type, len, val);
+		if (!ret_plain && ret_res) {
+			fprintf(stderr, "tlv-reserve: sorted %d seed %u: set of %d bytes failed at step %d\n",
+				sorted, seed, len, i);
+			fail = 1;
+		} else if (ret_plain && !ret_res) {
+			/* Keep the stores in step */
+			tlvs_del(res, type);
+		}
+
+		for (type = 1; type <= TYPES; type++) {
+			len_res = tlvs_get(res, type, sizeof(got_res), (char *)got_res);
+			len_plain = tlvs_get(plain, type, sizeof(got_plain), (char *)got_plain);
+			if (len_res != len_plain || (len_res > 0 && memcmp(got_res, got_plain, len_res))) {
+				fprintf(stderr, "tlv-reserve: sorted %d seed %u: type %d differs at step %d\n",
+					sorted, seed, type, i);
+				fail = 1;
+			}
+		}
+	}
+
+	tlvs_free(res);
+	tlvs_free(plain);
+	return fail ? -1 : 0;
+}
+
+static int rebuild_run(int convert)
+{
+	static const char long_val[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+	unsigned char mem[48];
+	struct tlv_store *tlvs;
+	char got[64];
+	int ret;
+
+	/* Reserved record first, no room for its slack once rewritten */
+	memset(mem, 0xFF, sizeof(mem));
+	tlvs = tlvs_init(mem, sizeof(mem));
+	tlvs_reserve(tlvs, 1, 16);
+	tlvs_set(tlvs, 16, sizeof(long_val) - 1, (void *)long_val);
+	tlvs_set(tlvs, 1, 1, "a");
+
+	if (convert) {
+		ret = tlvs_convert(tlvs, TLV_FORMAT_V2);
+	} else {
+		tlvs_set_sorted(tlvs, 1);
+		tlvs_optimise(tlvs);
+		ret = 0;
+	}
+
+	if (ret || tlvs_get(tlvs, 16, sizeof(got), got) != sizeof(long_val) - 1 ||
+	    strcmp(got, long_val) || tlvs_get(tlvs, 1, sizeof(got), got) != 1) {
+		fprintf(stderr, "tlv-reserve: %s lost records\n", convert ? "convert" : "sorted rebuild");
+		tlvs_free(tlvs);
+		return -1;
+	}
+
+	tlvs_free(tlvs);
+	return 0;
+}
+
+int main(void)
+{
+	int sorted, fail = 0;
+	unsigned int seed;
+
+	for (sorted = 0; sorted <= 1; sorted++)
+		for (seed = 1; seed <= 50; seed++)
+			fail |= reserve_run(sorted, seed);
+	fail |= rebuild_run(0);
+	fail |= rebuild_run(1);
+
+	printf("tlv-reserve: %s\n", fail ? "FAIL" : "ok");
+	return fail ? 1 : 0;
+}
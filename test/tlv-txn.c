@@ -0,0 +1,142 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tlv.h"
+
+/*
+ * Random transactions over nearly full stores: a commit applies every
+ * staged change or none. Storage of a failed commit, or of a prepared
+ * one that is aborted, is left byte for byte as it was and reads the
+ * values it had before.
+ */
+
+#define STORE_SIZE 1024
+#define STEPS 1000
+#define TYPES 16
+
+static unsigned char mem[STORE_SIZE], before[STORE_SIZE];
+static unsigned char values[TYPES + 1][300];
+static int lengths[TYPES + 1];
+
+static int txn_check(struct tlv_store *tlvs, int (*want)[TYPES + 1], const char *what,
+		     int mode, unsigned int seed, int step)
+{
+	unsigned char got[300];
+	ssize_t len;
+	int type;
+
+	for (type = 1; type <= TYPES; type++) {
+		len = tlvs_get(tlvs, type, sizeof(got), (char *)got);
+		if (len != (*want)[type] || (len > 0 && memcmp(got, values[type], len))) {
+			fprintf(stderr, "tlv-txn: %s: mode %d seed %u: type %d differs at step %d\n",
+				what, mode, seed, type, step);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static struct tlv_store *txn_open(int mode)
+{
+	struct tlv_store *tlvs;
+
+	if (mode == 2)
+		return tlvs_init_log(mem, sizeof(mem), TLV_FORMAT_V2);
+
+	tlvs = tlvs_init_format(mem, sizeof(mem), TLV_FORMAT_V2);
+	tlvs_set_sorted(tlvs, mode);
+	/* Reservations leave slack to give up when a change does not fit */
+	tlvs_reserve(tlvs, 1, 40);
+	tlvs_reserve(tlvs, 2, 100);
+	tlvs_reserve(tlvs, 3, 200);
+	return tlvs;
+}
+
+static int txn_run(int mode, unsigned int seed)
+{
+	int staged[TYPES + 1], ops[8][2];
+	unsigned char val[TYPES + 1][300];
+	struct tlv_store *tlvs;
+	int i, n, cnt, type, len, ret, abort, fail = 0;
+
+	srand(seed);
+	memset(mem, 0xFF, sizeof(mem));
+	for (type = 1; type <= TYPES; type++)
+		lengths[type] = -1;
+	tlvs = txn_open(mode);
+
+	for (i = 0; i < STEPS && !fail; i++) {
+		memcpy(before, mem, sizeof(mem));
+		memcpy(staged, lengths, sizeof(staged));
+		abort = rand() % 8 == 0;
+
+		tlvs_begin(tlvs);
+		cnt = 1 + rand() % 8;
+		for (n = 0; n < cnt; n++) {
+			type = 1 + rand() % TYPES;
+			len = rand() % 4 ? rand() % 120 : rand() % 300;
+			ops[n][0] = type;
+			ops[n][1] = rand() % 6 ? len : -1;
+			if (ops[n][1] < 0) {
+				tlvs_del(tlvs, type);
+				staged[type] = -1;
+			} else {
+				memset(val[type], rand(), len);
+				tlvs_set(tlvs, type, len, val[type]);
+				staged[type] = len;
+			}
+		}
+
+		if (abort) {
+			ret = tlvs_prepare(tlvs);
+			tlvs_abort(tlvs);
+			ret = ret ? ret : -ECANCELED;
+		} else {
+			ret = tlvs_commit(tlvs);
+		}
+
+		if (ret) {
+			if (memcmp(mem, before, sizeof(mem))) {
+				fprintf(stderr, "tlv-txn: mode %d seed %u: failed commit changed the storage at step %d\n",
+					mode, seed, i);
+				fail = 1;
+			}
+			fail |= txn_check(tlvs, &lengths, "failed commit", mode, seed, i);
+			continue;
+		}
+
+		for (n = 0; n < cnt; n++) {
+			type = ops[n][0];
+			if (staged[type] > 0)
+				memcpy(values[type], val[type], staged[type]);
+		}
+		memcpy(lengths, staged, sizeof(lengths));
+		fail |= txn_check(tlvs, &lengths, "commit", mode, seed, i);
+	}
+
+	/* Opened again from the storage alone */
+	tlvs_free(tlvs);
+	tlvs = mode == 2 ? tlvs_init_log(mem, sizeof(mem), TLV_FORMAT_V2) :
+			   tlvs_init_format(mem, sizeof(mem), TLV_FORMAT_V2);
+	fail |= txn_check(tlvs, &lengths, "reopen", mode, seed, i);
+	tlvs_free(tlvs);
+
+	return fail ? -1 : 0;
+}
+
+int main(void)
+{
+	unsigned int seed;
+	int mode, fail = 0;
+
+	/* Unsorted, sorted and log stores */
+	for (mode = 0; mode <= 2; mode++)
+		for (seed = 1; seed <= 40; seed++)
+			fail |= txn_run(mode, seed);
+
+	printf("tlv-txn: %s\n", fail ? "FAIL" : "ok");
+	return fail ? 1 : 0;
+}
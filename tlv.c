@@ -6,12 +6,134 @@
 #include <string.h>
 #include <arpa/inet.h>
 
+#include "crc.h"
 #include "tlv.h"
+#include "utils.h"
 
 #define TLV_EMPTY 0xFF
 #define TLV_PAD 0x00
+/* Continuation of a value too long for a single record */
+#define TLV_CHUNK 0xFE
+/* Log mode deletion marker, value is the deleted type */
+#define TLV_DEL 0xFD
 
-#define TLV_PROPS(tlv) tlv->type, ntohs(tlv->length), ((void *)tlv - (void *)tlvs->base)
+/* Log bank header, all ones while the bank is erased */
+struct __attribute__ ((__packed__)) tlv_log_bank {
+	uint32_t seq;
+};
+
+#define TLV_LOG_ERASED 0xFFFFFFFF
+/* Log record trailer, CRC-16 of the header and value */
+#define TLV_LOG_CRC 2
+
+#define TLV_PROPS(tlv) tlv->type, tlvs_val_len(tlvs, tlv), ((void *)tlv - (void *)tlvs->base)
+
+/* Longest varint length encoding, enough for 16-bit lengths */
+#define TLV_VARINT_MAX 3
+
+/*
+ * Record header is the type byte followed by the value length, either
+ * 16-bit big endian (TLV_FORMAT_V1) or a varint of 7 bits per byte, low
+ * bits first (TLV_FORMAT_V2). Varint may be wider than needed, so records
+ * keep their header width when shrunk in place.
+ */
+static size_t tlv_hdr_len(int format, const struct tlv_field *tlv)
+{
+	const uint8_t *len = (const uint8_t *)tlv + 1;
+	size_t i;
+
+	if (format == TLV_FORMAT_V1)
+		return sizeof(*tlv);
+
+	for (i = 0; i < TLV_VARINT_MAX - 1 && (len[i] & 0x80); i++)
+		;
+
+	return i + 2;
+}
+
+static uint16_t tlv_val_len(int format, const struct tlv_field *tlv)
+{
+	const uint8_t *len = (const uint8_t *)tlv + 1;
+	uint32_t val = 0;
+	size_t i;
+
+	if (format == TLV_FORMAT_V1)
+		return ntohs(tlv->length);
+
+	for (i = 0; i < TLV_VARINT_MAX; i++) {
+		val |= (uint32_t)(len[i] & 0x7F) << (7 * i);
+		if (!(len[i] & 0x80))
+			break;
+	}
+
+	return val > 0xFFFF ? 0xFFFF : val;
+}
+
+/* Smallest header able to hold the length */
+static size_t tlv_hdr_need(int format, uint16_t length)
+{
+	if (format == TLV_FORMAT_V1)
+		return sizeof(struct tlv_field);
+
+	return length < 0x80 ? 2 : length < 0x4000 ? 3 : 4;
+}
+
+static void tlv_hdr_encode(int format, uint8_t *hdr, uint8_t type, uint16_t length, size_t width)
+{
+	size_t i;
+
+	hdr[0] = type;
+	if (format == TLV_FORMAT_V1) {
+		hdr[1] = length >> 8;
+		hdr[2] = length & 0xFF;
+		return;
+	}
+
+	for (i = 1; i < width; i++) {
+		hdr[i] = length & 0x7F;
+		length >>= 7;
+		if (i < width - 1)
+			hdr[i] |= 0x80;
+	}
+}
+
+static size_t tlvs_hdr_len(struct tlv_store *tlvs, const struct tlv_field *tlv)
+{
+	return tlv_hdr_len(tlvs->format, tlv);
+}
+
+static uint16_t tlvs_val_len(struct tlv_store *tlvs, const struct tlv_field *tlv)
+{
+	return tlv_val_len(tlvs->format, tlv);
+}
+
+static uint8_t *tlvs_val(struct tlv_store *tlvs, struct tlv_field *tlv)
+{
+	return (uint8_t *)tlv + tlvs_hdr_len(tlvs, tlv);
+}
+
+/* Whole record length in storage */
+static size_t tlvs_rec_len(struct tlv_store *tlvs, const struct tlv_field *tlv)
+{
+	return tlvs_hdr_len(tlvs, tlv) + tlvs_val_len(tlvs, tlv) + tlvs->trail;
+}
+
+static size_t tlvs_hdr_need(struct tlv_store *tlvs, uint16_t length)
+{
+	return tlv_hdr_need(tlvs->format, length);
+}
+
+/* Sorted mode order: type, then owner and sequence of continuations */
+static uint32_t tlv_key(int format, const struct tlv_field *tlv)
+{
+	const uint8_t *val = (const uint8_t *)tlv + tlv_hdr_len(format, tlv);
+	uint32_t key = (uint32_t)tlv->type << 16;
+
+	if (tlv->type == TLV_CHUNK && tlv_val_len(format, tlv) >= sizeof(struct tlv_chunk))
+		key |= val[0] << 8 | val[1];
+
+	return key;
+}
 
 #ifdef DEBUG
 #define TLV_DEBUG(op, tlv) fprintf(stderr, op " TLV[%x] data # %i @ 0x%02lx\n", TLV_PROPS(tlv))
@@ -19,226 +141,1945 @@
 #define TLV_DEBUG(op, tlv)
 #endif
 
-struct tlv_store *tlvs_init(void *mem, int len)
-{
-	struct tlv_store *tlvs;
+/* Header bytes read ahead of a record walk, continuation owner and sequence included */
+#define TLV_HDR_FETCH (1 + TLV_VARINT_MAX + sizeof(struct tlv_chunk))
+
+/* Reads bytes of paged storage before they are used, others are readable */
+static int tlvs_fetch(struct tlv_store *tlvs, const void *addr, size_t len)
+{
+	if (!tlvs->fetch || !len)
+		return 0;
+
+	if (tlvs->fetch(tlvs->fetch_arg, addr, len)) {
+		tlvs->fetch_err = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Reads the record header at addr, up to the end of the storage */
+static int tlvs_fetch_hdr(struct tlv_store *tlvs, const void *addr)
+{
+	size_t len = tlvs->base + tlvs->size - addr;
+
+	return tlvs_fetch(tlvs, addr, len < TLV_HDR_FETCH ? len : TLV_HDR_FETCH);
+}
+
+/* Length of the padding run at addr, paged storage is read piecewise */
+static size_t tlvs_pad_len(struct tlv_store *tlvs, const void *addr, size_t len)
+{
+	size_t run = 0, step, span;
+
+	if (!tlvs->fetch)
+		return bspan_byte(addr, len, TLV_PAD);
+
+	while (run < len) {
+		step = len - run < 64 ? len - run : 64;
+		if (tlvs_fetch(tlvs, addr + run, step))
+			break;
+		span = bspan_byte(addr + run, step, TLV_PAD);
+		run += span;
+		if (span < step)
+			break;
+	}
+
+	return run;
+}
+
+/*
+ * Folds the difference between current and new bytes into the tracked
+ * CRC. CRC is linear, so CRC of XOR of old and new content, advanced
+ * over the data that follows the change, is the CRC difference. Bytes
+ * beyond the tracked length are picked up by tlvs_crc() later.
+ */
+static void tlvs_crc_delta(struct tlv_store *tlvs, const unsigned char *dst,
+			   const unsigned char *src, unsigned char c, size_t len)
+{
+	size_t i, off = (void *)dst - tlvs->base;
+	uint32_t raw = 0;
+
+	if (!tlvs->crc_valid || off >= tlvs->crc_len)
+		return;
+
+	if (len > tlvs->crc_len - off)
+		len = tlvs->crc_len - off;
+
+	for (i = 0; i < len; i++)
+		raw = update_crc_32(raw, dst[i] ^ (src ? src[i] : c));
+
+	tlvs->crc ^= crc32_shift(raw, tlvs->crc_len - off - len);
+}
+
+static void tlvs_write(struct tlv_store *tlvs, void *dst, const void *src, size_t len)
+{
+	tlvs_fetch(tlvs, dst, len);
+	tlvs_fetch(tlvs, src, len);
+	tlvs_crc_delta(tlvs, dst, src, 0, len);
+	memmove(dst, src, len);
+	tlvs->stats.bytes_written += len;
+}
+
+static void tlvs_fill(struct tlv_store *tlvs, void *dst, unsigned char c, size_t len)
+{
+	tlvs_fetch(tlvs, dst, len);
+	tlvs_crc_delta(tlvs, dst, NULL, c, len);
+	memset(dst, c, len);
+	tlvs->stats.bytes_written += len;
+}
+
+/* Rewrites the length, keeping the header width */
+static void tlvs_write_len(struct tlv_store *tlvs, struct tlv_field *tlv, uint16_t length)
+{
+	uint8_t hdr[TLV_VARINT_MAX + 1];
+	size_t width = tlvs_hdr_len(tlvs, tlv);
+
+	tlv_hdr_encode(tlvs->format, hdr, tlv->type, length, width);
+	tlvs_write(tlvs, (uint8_t *)tlv + 1, hdr + 1, width - 1);
+}
+
+static int tlvs_hole_cmp(struct tlv_extent *a, size_t length, size_t offset)
+{
+	if (a->length != length)
+		return a->length < length ? -1 : 1;
+	if (a->offset != offset)
+		return a->offset < offset ? -1 : 1;
+	return 0;
+}
+
+/* Index of the first hole ordered at or after given length and offset */
+static int tlvs_hole_bound(struct tlv_store *tlvs, size_t length, size_t offset)
+{
+	int lo = 0, hi = tlvs->holes_cnt, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (tlvs_hole_cmp(&tlvs->holes[mid], length, offset) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Index of the first hole at or after the offset, in offset order */
+static int tlvs_span_bound(struct tlv_store *tlvs, size_t offset)
+{
+	int lo = 0, hi = tlvs->holes_cnt, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (tlvs->spans[mid].offset < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void tlvs_hole_remove(struct tlv_store *tlvs, int idx)
+{
+	int pos = tlvs_span_bound(tlvs, tlvs->holes[idx].offset);
+
+	tlvs->frag -= tlvs->holes[idx].length;
+	tlvs->holes_cnt--;
+	memmove(&tlvs->holes[idx], &tlvs->holes[idx + 1],
+		(tlvs->holes_cnt - idx) * sizeof(*tlvs->holes));
+	memmove(&tlvs->spans[pos], &tlvs->spans[pos + 1],
+		(tlvs->holes_cnt - pos) * sizeof(*tlvs->spans));
+}
+
+/* Hole starting at the offset, -1 when there is none */
+static int tlvs_hole_at(struct tlv_store *tlvs, size_t offset)
+{
+	int pos = tlvs_span_bound(tlvs, offset);
+
+	if (pos == tlvs->holes_cnt || tlvs->spans[pos].offset != offset)
+		return -1;
+
+	return tlvs_hole_bound(tlvs, tlvs->spans[pos].length, offset);
+}
+
+/* Moves a hole to another offset, the caller keeps both orders intact */
+static void tlvs_hole_shift(struct tlv_store *tlvs, int pos, size_t shift)
+{
+	int idx = tlvs_hole_bound(tlvs, tlvs->spans[pos].length, tlvs->spans[pos].offset);
+
+	tlvs->holes[idx].offset += shift;
+	tlvs->spans[pos].offset += shift;
+}
+
+static int tlvs_holes_grow(struct tlv_store *tlvs)
+{
+	struct tlv_extent *tmp;
+
+	tmp = realloc(tlvs->holes, (tlvs->holes_max + 16) * sizeof(*tmp));
+	if (!tmp)
+		return -ENOMEM;
+	tlvs->holes = tmp;
+
+	tmp = realloc(tlvs->spans, (tlvs->holes_max + 16) * sizeof(*tmp));
+	if (!tmp)
+		return -ENOMEM;
+	tlvs->spans = tmp;
+
+	tlvs->holes_max += 16;
+	return 0;
+}
+
+/*
+ * Registers padding run, merging it with directly adjacent holes. Holes
+ * are kept ordered by length for best fit and by offset for neighbours.
+ * When memory is short the run is left untracked and the map is marked
+ * for a rescan before the next modification.
+ */
+static int tlvs_hole_insert(struct tlv_store *tlvs, size_t offset, size_t length)
+{
+	int idx, pos;
+
+	if (!length)
+		return 0;
+
+	pos = tlvs_span_bound(tlvs, offset);
+	if (pos > 0 && tlvs->spans[pos - 1].offset + tlvs->spans[pos - 1].length == offset) {
+		pos--;
+		offset = tlvs->spans[pos].offset;
+		length += tlvs->spans[pos].length;
+		tlvs_hole_remove(tlvs, tlvs_hole_at(tlvs, offset));
+	}
+	if (pos < tlvs->holes_cnt && tlvs->spans[pos].offset == offset + length) {
+		idx = tlvs_hole_at(tlvs, offset + length);
+		length += tlvs->spans[pos].length;
+		tlvs_hole_remove(tlvs, idx);
+	}
+
+	if (tlvs->holes_cnt == tlvs->holes_max && tlvs_holes_grow(tlvs)) {
+		perror("realloc() failed");
+		tlvs->holes_stale = 1;
+		return -ENOMEM;
+	}
+
+	idx = tlvs_hole_bound(tlvs, length, offset);
+	memmove(&tlvs->holes[idx + 1], &tlvs->holes[idx],
+		(tlvs->holes_cnt - idx) * sizeof(*tlvs->holes));
+	tlvs->holes[idx].offset = offset;
+	tlvs->holes[idx].length = length;
+	memmove(&tlvs->spans[pos + 1], &tlvs->spans[pos],
+		(tlvs->holes_cnt - pos) * sizeof(*tlvs->spans));
+	tlvs->spans[pos].offset = offset;
+	tlvs->spans[pos].length = length;
+	tlvs->holes_cnt++;
+	tlvs->frag += length;
+	return 0;
+}
+
+/* Slack wanted after the record to reach its reserved capacity */
+static size_t tlvs_slack_want(struct tlv_store *tlvs, struct tlv_field *tlv)
+{
+	uint16_t length;
+
+	if (tlvs->log || tlv->type == TLV_CHUNK || tlv->type == TLV_DEL)
+		return 0;
+
+	length = tlvs_val_len(tlvs, tlv);
+	return tlvs->reserve[tlv->type] > length ? tlvs->reserve[tlv->type] - length : 0;
+}
+
+/* Padding from end of a record up to the next hole, record slack */
+static size_t tlvs_slack(struct tlv_store *tlvs, size_t end)
+{
+	size_t run;
+	int pos;
+
+	if (end >= tlvs->tail)
+		return 0;
+
+	run = bspan_byte(tlvs->base + end, tlvs->tail - end, TLV_PAD);
+	pos = tlvs_span_bound(tlvs, end);
+	if (pos < tlvs->holes_cnt && tlvs->spans[pos].offset < end + run)
+		run = tlvs->spans[pos].offset - end;
+
+	return run;
+}
+
+/*
+ * Brings slack of the record to its reservation: excess is returned to
+ * the holes map, shortage is taken from the hole that follows and, when
+ * extend is set, from the free tail.
+ */
+static void tlvs_slack_claim(struct tlv_store *tlvs, struct tlv_field *tlv, int extend)
+{
+	struct tlv_extent gap;
+	size_t end, have, want, take;
+	int idx;
+
+	if (tlvs->log || tlvs->slack_hold)
+		return;
+
+	end = (void *)tlv - tlvs->base + tlvs_rec_len(tlvs, tlv);
+	want = tlvs_slack_want(tlvs, tlv);
+	have = tlvs_slack(tlvs, end);
+	if (have > want) {
+		tlvs_hole_insert(tlvs, end + want, have - want);
+		return;
+	}
+	if (have == want)
+		return;
+
+	idx = tlvs_hole_at(tlvs, end + have);
+	if (idx >= 0) {
+		gap = tlvs->holes[idx];
+		take = gap.length < want - have ? gap.length : want - have;
+		tlvs_hole_remove(tlvs, idx);
+		tlvs_hole_insert(tlvs, gap.offset + take, gap.length - take);
+	} else if (extend && end + have == tlvs->tail && tlvs->tail + 1 < tlvs->size) {
+		take = tlvs->size - tlvs->tail - 1;
+		if (take > want - have)
+			take = want - have;
+		tlvs_fill(tlvs, tlvs->base + tlvs->tail, TLV_PAD, take);
+		tlvs->tail += take;
+		tlvs->dirty = 1;
+	}
+}
+
+/* Total slack of the stored records */
+static size_t tlvs_slack_total(struct tlv_store *tlvs)
+{
+	size_t end, total = 0;
+	int i;
+
+	for (i = 0; !tlvs->log && i < TLV_TYPES; i++) {
+		if (!tlvs->reserve[i] || tlvs->index[i] < 0)
+			continue;
+		end = tlvs->index[i] + tlvs_rec_len(tlvs, tlvs->base + tlvs->index[i]);
+		total += tlvs_slack(tlvs, end);
+	}
+
+	return total;
+}
+
+/*
+ * Turns slack of all stored records into holes, for a record that does
+ * not fit otherwise. Reservations never make a placement fail that would
+ * succeed without them. Returns bytes released.
+ */
+static size_t tlvs_slack_release(struct tlv_store *tlvs)
+{
+	size_t end, run, total = 0;
+	int i;
+
+	for (i = 0; !tlvs->log && i < TLV_TYPES; i++) {
+		if (!tlvs->reserve[i] || tlvs->index[i] < 0)
+			continue;
+		end = tlvs->index[i] + tlvs_rec_len(tlvs, tlvs->base + tlvs->index[i]);
+		run = tlvs_slack(tlvs, end);
+		if (!tlvs_hole_insert(tlvs, end, run))
+			total += run;
+	}
+
+	return total;
+}
+
+/* Reserved records take back slack from the holes that follow them */
+static void tlvs_slack_reclaim(struct tlv_store *tlvs, int extend)
+{
+	int i;
+
+	for (i = 0; i < TLV_TYPES; i++) {
+		if (tlvs->reserve[i] && tlvs->index[i] >= 0)
+			tlvs_slack_claim(tlvs, tlvs->base + tlvs->index[i], extend);
+	}
+}
+
+/* Log record lies within the bank and matches its crc */
+static int tlvs_log_valid(struct tlv_store *tlvs, size_t off, struct tlv_field *tlv)
+{
+	const uint8_t *crc;
+	size_t len;
+
+	len = tlvs_hdr_len(tlvs, tlv) + tlvs_val_len(tlvs, tlv);
+	if (len + TLV_LOG_CRC > tlvs->size - off || tlvs_fetch(tlvs, tlv, len + TLV_LOG_CRC))
+		return 0;
+
+	crc = (const uint8_t *)tlv + len;
+	return crc_16((const unsigned char *)tlv, len) == (crc[0] << 8 | crc[1]);
+}
+
+/* Writes the crc trailer of a log record, last so a torn record fails it */
+static void tlvs_log_seal(struct tlv_store *tlvs, struct tlv_field *tlv)
+{
+	size_t len = tlvs_hdr_len(tlvs, tlv) + tlvs_val_len(tlvs, tlv);
+	uint16_t crc = crc_16((const unsigned char *)tlv, len);
+	uint8_t buf[TLV_LOG_CRC] = { crc >> 8, crc };
+
+	tlvs_write(tlvs, (uint8_t *)tlv + len, buf, sizeof(buf));
+}
+
+/* Whether a log record is the newest of its type or belongs to it */
+static int tlvs_log_live(struct tlv_store *tlvs, size_t off, struct tlv_field *tlv)
+{
+	uint8_t owner;
+
+	if (tlv->type == TLV_DEL)
+		return 0;
+	if (tlv->type != TLV_CHUNK)
+		return tlvs->index[tlv->type] == (ssize_t)off;
+	if (tlvs_val_len(tlvs, tlv) < sizeof(struct tlv_chunk))
+		return 0;
+
+	/* Continuations follow their head record */
+	owner = tlvs_val(tlvs, tlv)[0];
+	return tlvs->index[owner] >= 0 && (ssize_t)off > tlvs->index[owner];
+}
+
+/*
+ * Log mode scan: later records replace earlier ones of the same type and
+ * deletion markers drop the type. Everything not live counts as frag.
+ * Log ends at the first record failing its crc or running past the bank,
+ * a torn append, the next append takes its place.
+ */
+static void tlvs_log_scan(struct tlv_store *tlvs)
+{
+	struct tlv_field *tlv;
+	size_t curr = 0, end, live = 0;
+	uint8_t type;
+
+	tlvs->tail = tlvs->size;
+	while (curr + tlvs->hdr_min < tlvs->size) {
+		tlv = tlvs->base + curr;
+		if (tlvs_fetch_hdr(tlvs, tlv))
+			return;
+		if (tlv->type == TLV_EMPTY)
+			break;
+		if (!tlvs_log_valid(tlvs, curr, tlv)) {
+			if (!tlvs->fetch_err)
+				tlvs->tail = curr;
+			break;
+		}
+		type = tlvs_val_len(tlvs, tlv) ? tlvs_val(tlvs, tlv)[0] : TLV_EMPTY;
+		if (tlv->type == TLV_DEL) {
+			tlvs->index[type] = -1;
+			tlvs->chunks[type] = 0;
+		} else if (tlv->type == TLV_CHUNK) {
+			if (tlvs_val_len(tlvs, tlv) >= sizeof(struct tlv_chunk))
+				tlvs->chunks[type]++;
+		} else {
+			tlvs->index[tlv->type] = curr;
+			tlvs->chunks[tlv->type] = 0;
+		}
+		curr += tlvs_rec_len(tlvs, tlv);
+	}
+	end = curr;
+	if (curr < tlvs->size && !tlvs_fetch(tlvs, tlvs->base + curr, 1) &&
+	    *(uint8_t *)(tlvs->base + curr) == TLV_EMPTY)
+		tlvs->tail = curr;
+
+	for (curr = 0; curr < end; curr += tlvs_rec_len(tlvs, tlv)) {
+		tlv = tlvs->base + curr;
+		if (tlvs_log_live(tlvs, curr, tlv))
+			live += tlvs_rec_len(tlvs, tlv);
+	}
+	/* Space past the last record is reclaimed by collection only */
+	tlvs->frag = tlvs->tail - live;
+}
+
+/*
+ * Walks the whole storage area once and rebuilds the in-memory type
+ * index, the end of data offset and the holes map. Must be called after
+ * any operation that moves records around.
+ */
+static void tlvs_scan(struct tlv_store *tlvs)
+{
+	void *last, *curr, *pad;
+	struct tlv_field *tlv;
+	int i;
+
+	for (i = 0; i < TLV_TYPES; i++)
+		tlvs->index[i] = -1;
+	memset(tlvs->chunks, 0, sizeof(tlvs->chunks));
+	tlvs->holes_cnt = 0;
+	tlvs->holes_stale = 0;
+	tlvs->frag = 0;
+
+	if (tlvs->log) {
+		tlvs_log_scan(tlvs);
+		return;
+	}
+
+	curr = tlvs->base;
+	last = tlvs->base + tlvs->size;
+	tlvs->tail = tlvs->size;
+
+	while ((curr + tlvs->hdr_min) < last) {
+		tlv = curr;
+		/* Paged storage is read header by header, values stay unread */
+		if (tlvs_fetch_hdr(tlvs, tlv))
+			return;
+		if (tlv->type == TLV_EMPTY) {
+			tlvs->tail = curr - tlvs->base;
+			break;
+		}
+		/* Padding (holes) handling */
+		if (tlv->type == TLV_PAD) {
+			pad = curr;
+			curr += tlvs_pad_len(tlvs, curr, last - curr);
+			tlvs_hole_insert(tlvs, pad - tlvs->base, curr - pad);
+			continue;
+		}
+		/* Record running past the storage ends the data */
+		if (tlvs_rec_len(tlvs, tlv) > last - curr) {
+			tlvs->tail = curr - tlvs->base;
+			break;
+		}
+		/* First occurrence wins, same as linear lookup */
+		if (tlv->type == TLV_CHUNK) {
+			if (tlvs_val_len(tlvs, tlv) >= sizeof(struct tlv_chunk))
+				tlvs->chunks[tlvs_val(tlvs, tlv)[0]]++;
+		} else if (tlvs->index[tlv->type] < 0)
+			tlvs->index[tlv->type] = curr - tlvs->base;
+		curr += tlvs_rec_len(tlvs, tlv);
+	}
+
+	/* Padding or free space too short to hold a record header at the very end */
+	pad = curr;
+	if (curr < last)
+		curr += tlvs_pad_len(tlvs, curr, last - curr);
+	if (curr > pad)
+		tlvs_hole_insert(tlvs, pad - tlvs->base, curr - pad);
+	if (curr < last && !tlvs_fetch(tlvs, curr, 1) && *(uint8_t *)curr == TLV_EMPTY)
+		tlvs->tail = curr - tlvs->base;
+}
+
+/* Rescans the storage when padding runs were left out of the holes map */
+static void tlvs_holes_sync(struct tlv_store *tlvs)
+{
+	if (!tlvs->holes_stale)
+		return;
+
+	tlvs_scan(tlvs);
+	tlvs_slack_reclaim(tlvs, 0);
+}
+
+static struct tlv_store *tlvs_alloc(void *mem, int len, int format)
+{
+	struct tlv_store *tlvs;
+
+	assert(mem != NULL);
+	assert(len != 0);
+
+	tlvs = calloc(1, sizeof(*tlvs));
+	if (!tlvs) {
+		perror("calloc() failed");
+		return NULL;
+	}
+
+	tlvs->size = len;
+	tlvs->base = mem;
+	tlvs->format = format;
+	tlvs->hdr_min = tlv_hdr_need(format, 0);
+
+	return tlvs;
+}
+
+struct tlv_store *tlvs_init_format(void *mem, int len, int format)
+{
+	return tlvs_init_paged(mem, len, format, NULL, NULL);
+}
+
+/* Opens storage read through fetch, NULL when it cannot be read */
+struct tlv_store *tlvs_init_paged(void *mem, int len, int format,
+				  tlv_fetch_cb_t fetch, void *arg)
+{
+	struct tlv_store *tlvs;
+
+	tlvs = tlvs_alloc(mem, len, format);
+	if (!tlvs)
+		return NULL;
+
+	tlvs->fetch = fetch;
+	tlvs->fetch_arg = arg;
+	tlvs_scan(tlvs);
+	if (tlvs->fetch_err) {
+		tlvs_free(tlvs);
+		return NULL;
+	}
+
+	return tlvs;
+}
+
+/*
+ * Opens a container value, records in the store format ended by
+ * TLV_EMPTY, as a store of its own. Only the container bytes are
+ * scanned. Nested store is for reading and is valid until the next
+ * modification of the parent, NULL when the value is not a container.
+ */
+struct tlv_store *tlvs_init_nested(struct tlv_store *tlvs, const struct tlv_view *view)
+{
+	struct tlv_store *sub;
+
+	if (!view->len)
+		return NULL;
+
+	sub = tlvs_init_format((void *)view->data, view->len, tlvs->format);
+	if (!sub)
+		return NULL;
+
+	/* No end marker, last record runs past the container */
+	if (sub->tail >= sub->size) {
+		tlvs_free(sub);
+		return NULL;
+	}
+
+	return sub;
+}
+
+/* Moves the store onto an identical copy of its storage area */
+void tlvs_rebase(struct tlv_store *tlvs, void *mem)
+{
+	tlvs->base = mem;
+}
+
+/* Makes the bank active, writing its header when seq is new */
+static void tlvs_log_start(struct tlv_store *tlvs, int bank, uint32_t seq)
+{
+	struct tlv_log_bank *hdr = tlvs->banks[bank];
+
+	if (ntohl(hdr->seq) != seq) {
+		hdr->seq = htonl(seq);
+		tlvs->stats.bytes_written += sizeof(*hdr);
+		tlvs->dirty = 1;
+	}
+
+	tlvs->bank = bank;
+	tlvs->seq = seq;
+	tlvs->base = tlvs->banks[bank] + sizeof(*hdr);
+	tlvs->size = tlvs->bank_size - sizeof(*hdr);
+}
+
+/*
+ * Opens the storage as an append-only log split into two banks. Active
+ * bank is the valid one with the newer sequence number, blank storage
+ * starts with bank 0.
+ */
+struct tlv_store *tlvs_init_log(void *mem, int len, int format)
+{
+	return tlvs_init_log_paged(mem, len, format, NULL, NULL);
+}
+
+struct tlv_store *tlvs_init_log_paged(void *mem, int len, int format,
+				      tlv_fetch_cb_t fetch, void *arg)
+{
+	struct tlv_store *tlvs;
+	struct tlv_log_bank *hdr;
+	uint32_t seq[2];
+	int i, bank;
+
+	if (len / 2 <= sizeof(*hdr) + tlv_hdr_need(format, 0) + TLV_LOG_CRC)
+		return NULL;
+
+	tlvs = tlvs_alloc(mem, len, format);
+	if (!tlvs)
+		return NULL;
+
+	tlvs->log = 1;
+	tlvs->trail = TLV_LOG_CRC;
+	tlvs->fetch = fetch;
+	tlvs->fetch_arg = arg;
+	tlvs->bank_size = len / 2;
+	for (i = 0; i < 2; i++) {
+		tlvs->banks[i] = mem + i * tlvs->bank_size;
+		hdr = tlvs->banks[i];
+		if (tlvs_fetch(tlvs, hdr, sizeof(*hdr))) {
+			tlvs_free(tlvs);
+			return NULL;
+		}
+		seq[i] = ntohl(hdr->seq);
+	}
+
+	if (seq[0] == TLV_LOG_ERASED && seq[1] == TLV_LOG_ERASED)
+		seq[0] = 1;
+	if (seq[0] == TLV_LOG_ERASED)
+		bank = 1;
+	else if (seq[1] == TLV_LOG_ERASED)
+		bank = 0;
+	else
+		bank = (int32_t)(seq[1] - seq[0]) > 0;
+
+	tlvs_log_start(tlvs, bank, seq[bank]);
+	tlvs_scan(tlvs);
+	if (tlvs->fetch_err) {
+		tlvs_free(tlvs);
+		return NULL;
+	}
+
+	return tlvs;
+}
+
+/*
+ * Log mode collection: live records are copied into the spare bank,
+ * which takes over once its header with the next sequence number is
+ * written. The old bank stays valid until then and is erased when it
+ * becomes the spare of the next collection.
+ */
+static void tlvs_log_gc(struct tlv_store *tlvs)
+{
+	struct tlv_field *tlv;
+	void *spare = tlvs->banks[!tlvs->bank];
+	void *dst = spare + sizeof(struct tlv_log_bank);
+	size_t curr, len;
+
+	if (tlvs_fetch(tlvs, spare, tlvs->bank_size))
+		return;
+	if (!bempty_data(spare, tlvs->bank_size)) {
+		memset(spare, TLV_EMPTY, tlvs->bank_size);
+		tlvs->stats.erase++;
+	}
+
+	for (curr = 0; curr < tlvs->tail; curr += len) {
+		tlv = tlvs->base + curr;
+		len = tlvs_rec_len(tlvs, tlv);
+		if (!tlvs_log_live(tlvs, curr, tlv))
+			continue;
+		/* Old bank stays active when a record cannot be read */
+		if (tlvs_fetch(tlvs, tlv, len))
+			return;
+		memcpy(dst, tlv, len);
+		dst += len;
+		tlvs->stats.bytes_written += len;
+	}
+
+	tlvs_log_start(tlvs, !tlvs->bank, tlvs->seq + 1);
+	tlvs_scan(tlvs);
+	tlvs->stats.compact++;
+}
+
+struct tlv_store *tlvs_init(void *mem, int len)
+{
+	return tlvs_init_format(mem, len, TLV_FORMAT_V1);
+}
+
+void tlvs_free(struct tlv_store *tlvs)
+{
+	tlvs_abort(tlvs);
+#ifdef DEBUG
+	fprintf(stderr, "TLV set stats: skip %u, same %u, shrink %u, grow %u, move %u\n",
+		tlvs->stats.set_skip, tlvs->stats.set_same, tlvs->stats.set_shrink,
+		tlvs->stats.set_grow, tlvs->stats.set_move);
+	fprintf(stderr, "TLV frag stats: %zu bytes in %i holes, %u compactions\n",
+		tlvs->frag, tlvs->holes_cnt, tlvs->stats.compact);
+	fprintf(stderr, "TLV write stats: %lu value bytes, %lu written, amplification %.2f, %u erases\n",
+		tlvs->stats.bytes_value, tlvs->stats.bytes_written,
+		tlvs->stats.bytes_value ?
+		(double)tlvs->stats.bytes_written / tlvs->stats.bytes_value : 0.0,
+		tlvs->stats.erase);
+#endif
+	free(tlvs->holes);
+	free(tlvs->spans);
+	free(tlvs);
+}
+
+void tlvs_reset(struct tlv_store *tlvs)
+{
+	tlvs_fetch(tlvs, tlvs->base, tlvs->size);
+	memset(tlvs->base, TLV_EMPTY, tlvs->size);
+	tlvs_scan(tlvs);
+	tlvs->crc_valid = 0;
+
+	tlvs->dirty = 1;
+}
+
+/*
+ * Slides records following the first hole down over the padding, moving
+ * at most budget bytes (no limit when zero) and at least one record.
+ * Padding left behind an interrupted pass is merged into a single hole
+ * in front of the records not moved yet. Returns remaining fragmented
+ * bytes.
+ */
+static size_t tlvs_compact_step(struct tlv_store *tlvs, size_t budget)
+{
+	struct tlv_field *tlv;
+	size_t first, save, curr, count, slack, moved = 0;
+
+	/* Log is never rewritten in place, collect it into the spare bank */
+	if (tlvs->log) {
+		if (tlvs->frag)
+			tlvs_log_gc(tlvs);
+		return tlvs->frag;
+	}
+
+	if (!tlvs->holes_cnt)
+		return tlvs->frag;
+
+	first = tlvs->spans[0].offset;
+
+	save = curr = first;
+	while (curr < tlvs->tail) {
+		tlv = tlvs->base + curr;
+		if (tlv->type == TLV_PAD) {
+			curr += bspan_byte(tlv, tlvs->tail - curr, TLV_PAD);
+			continue;
+		}
+		if (tlv->type == TLV_EMPTY)
+			break;
+		count = tlvs_rec_len(tlvs, tlv);
+		if (budget && moved && moved + count > budget)
+			break;
+		if (tlvs->index[tlv->type] == (ssize_t)curr)
+			tlvs->index[tlv->type] = save;
+		/* Reserved records keep their slack, taken from the padding closed */
+		slack = tlvs->slack_hold ? 0 : tlvs_slack_want(tlvs, tlv);
+		if (slack > curr - save)
+			slack = curr - save;
+		tlvs_write(tlvs, tlvs->base + save, tlv, count);
+		if (slack)
+			tlvs_fill(tlvs, tlvs->base + save + count, TLV_PAD, slack);
+		moved += count;
+		save += count + slack;
+		curr += count;
+	}
+
+	/* Holes up to here are consumed by the moved records */
+	while (tlvs->holes_cnt && tlvs->spans[0].offset < curr)
+		tlvs_hole_remove(tlvs, tlvs_hole_at(tlvs, tlvs->spans[0].offset));
+
+	if (curr < tlvs->tail) {
+		tlvs_fill(tlvs, tlvs->base + save, TLV_PAD, curr - save);
+		tlvs_hole_insert(tlvs, save, curr - save);
+	} else {
+		tlvs_fill(tlvs, tlvs->base + save, TLV_EMPTY, curr - save);
+		tlvs->tail = save;
+	}
+
+	tlvs->stats.compact++;
+	tlvs->dirty = 1;
+	return tlvs->frag;
+}
+
+static void tlvs_compact(struct tlv_store *tlvs)
+{
+	tlvs_compact_step(tlvs, 0);
+}
+
+static int tlvs_rebuild(struct tlv_store *tlvs, int format);
+
+/* Checks records are in key order, as sorted mode expects */
+static int tlvs_ordered(struct tlv_store *tlvs)
+{
+	struct tlv_field *tlv;
+	size_t curr = 0;
+	uint32_t key, last = 0;
+
+	while (curr < tlvs->tail) {
+		tlv = tlvs->base + curr;
+		if (tlv->type == TLV_PAD) {
+			curr += bspan_byte(tlv, tlvs->tail - curr, TLV_PAD);
+			continue;
+		}
+		if (tlv->type == TLV_EMPTY)
+			break;
+		key = tlv_key(tlvs->format, tlv);
+		if (key < last)
+			return 0;
+		last = key;
+		curr += tlvs_rec_len(tlvs, tlv);
+	}
+
+	return 1;
+}
+
+/*
+ * Compacts the storage. In sorted mode records found out of order, e.g.
+ * in an image written before the mode was enabled, are rewritten sorted.
+ */
+void tlvs_optimise(struct tlv_store *tlvs)
+{
+	tlvs_holes_sync(tlvs);
+	if (tlvs->sorted && !tlvs_ordered(tlvs) &&
+	    !tlvs_rebuild(tlvs, tlvs->format))
+		return;
+
+	if (!tlvs->frag)
+		return;
+
+	tlvs_compact(tlvs);
+}
+
+/*
+ * Sorted mode keeps records ordered by type, new records are placed
+ * between their neighbours. Existing records are reordered by the next
+ * tlvs_optimise().
+ */
+void tlvs_set_sorted(struct tlv_store *tlvs, int sorted)
+{
+	/* Log only appends */
+	tlvs->sorted = sorted && !tlvs->log;
+}
+
+size_t tlvs_optimise_step(struct tlv_store *tlvs, size_t budget)
+{
+	tlvs_holes_sync(tlvs);
+	if (!tlvs->frag)
+		return 0;
+
+	return tlvs_compact_step(tlvs, budget);
+}
+
+void tlvs_compact_policy(struct tlv_store *tlvs, size_t frag_limit, size_t budget)
+{
+	tlvs->frag_limit = frag_limit;
+	tlvs->compact_budget = budget;
+}
+
+/*
+ * Reserves value capacity for the type. New records are placed with
+ * trailing padding up to the capacity when there is room, so updates up
+ * to it are done in place. Padding already following the record is
+ * claimed without writes.
+ */
+void tlvs_reserve(struct tlv_store *tlvs, uint8_t type, uint16_t capacity)
+{
+	assert(type != TLV_EMPTY && type != TLV_PAD &&
+	       type != TLV_CHUNK && type != TLV_DEL);
+
+	if (tlvs->fetch_err)
+		return;
+
+	tlvs->reserve[type] = capacity;
+	if (tlvs->index[type] >= 0)
+		tlvs_slack_claim(tlvs, tlvs->base + tlvs->index[type], 0);
+}
+
+/* Compacts after a modification once fragmentation passes the limit */
+static void tlvs_autocompact(struct tlv_store *tlvs)
+{
+	if (!tlvs->frag_limit || tlvs->frag <= tlvs->frag_limit)
+		return;
+
+	tlvs_optimise_step(tlvs, tlvs->compact_budget);
+}
+
+/*
+ * Picks the smallest hole that fits a record of need bytes, falling back
+ * to the end of data. Selected hole is claimed, any remainder is kept as
+ * a hole.
+ */
+static struct tlv_field *tlvs_gap(struct tlv_store *tlvs, size_t need)
+{
+	struct tlv_extent gap;
+	int idx;
+
+	idx = tlvs_hole_bound(tlvs, need, 0);
+	if (idx < tlvs->holes_cnt) {
+		gap = tlvs->holes[idx];
+		tlvs_hole_remove(tlvs, idx);
+		tlvs_hole_insert(tlvs, gap.offset + need, gap.length - need);
+		return tlvs->base + gap.offset;
+	}
+
+	/* Append at the end of data when there is room left */
+	if (tlvs->tail + need >= tlvs->size)
+		return NULL;
+
+	return tlvs->base + tlvs->tail;
+}
+
+/*
+ * Locates the slot of a key in sorted mode: lo is the end of the last
+ * record ordered before it, hi the end of the padding that follows. Walk
+ * stops at the first record past the key, returns 1 when there is one.
+ */
+static int tlvs_sorted_slot(struct tlv_store *tlvs, uint32_t key, size_t *lo, size_t *hi)
+{
+	struct tlv_field *tlv;
+	size_t curr = 0;
+
+	*lo = 0;
+	while (curr < tlvs->tail) {
+		tlv = tlvs->base + curr;
+		if (tlv->type == TLV_PAD) {
+			curr += bspan_byte(tlv, tlvs->tail - curr, TLV_PAD);
+			continue;
+		}
+		if (tlv->type == TLV_EMPTY)
+			break;
+		if (tlv_key(tlvs->format, tlv) > key) {
+			*hi = curr;
+			return 1;
+		}
+		curr += tlvs_rec_len(tlvs, tlv);
+		/* Slack of the record is not free space */
+		if (tlv->type != TLV_CHUNK && tlvs->reserve[tlv->type])
+			curr += tlvs_slack(tlvs, curr);
+		*lo = curr;
+	}
+
+	*hi = curr;
+	return 0;
+}
+
+/*
+ * Sorted mode counterpart of tlvs_gap(): claims need bytes at the slot of
+ * the key. When padding there is too short, the records ordered after the
+ * key up to the nearest hole covering the rest slide up into it, or up to
+ * the free tail. Storage is compacted only when neither has room.
+ */
+static struct tlv_field *tlvs_sorted_gap(struct tlv_store *tlvs, uint32_t key, size_t need)
+{
+	struct tlv_field *tlv;
+	size_t lo, hi, curr, end, shift, stop, room;
+	int i, pos, first, next, compacted = 0;
+
+retry:
+	next = tlvs_sorted_slot(tlvs, key, &lo, &hi);
+	if (!next) {
+		/* Last in order, trailing padding and free tail are usable */
+		if (lo + need >= tlvs->size)
+			goto compact;
+		end = lo + need < hi ? lo + need : hi;
+	} else if (hi - lo >= need) {
+		end = lo + need;
+	} else {
+		shift = need - (hi - lo);
+		first = tlvs_span_bound(tlvs, hi + 1);
+		for (pos = first; pos < tlvs->holes_cnt; pos++) {
+			if (tlvs->spans[pos].length >= shift)
+				break;
+		}
+		if (pos == tlvs->holes_cnt && tlvs->tail + shift >= tlvs->size)
+			goto compact;
+
+		if (pos == tlvs->holes_cnt) {
+			stop = tlvs->tail;
+			room = shift;
+			tlvs->tail += shift;
+		} else {
+			stop = tlvs->spans[pos].offset;
+			room = tlvs->spans[pos].length;
+			tlvs_hole_remove(tlvs, tlvs_hole_at(tlvs, stop));
+		}
+		/* Smaller holes passed over move along, their order is kept */
+		for (i = pos - 1; i >= first; i--)
+			tlvs_hole_shift(tlvs, i, shift);
+		tlvs_hole_insert(tlvs, stop + shift, room - shift);
+		tlvs_write(tlvs, tlvs->base + hi + shift, tlvs->base + hi, stop - hi);
+
+		for (curr = hi + shift; curr < stop + shift; curr += tlvs_rec_len(tlvs, tlv)) {
+			tlv = tlvs->base + curr;
+			/* Slack of reserved records moves along */
+			if (tlv->type == TLV_PAD) {
+				curr += bspan_byte(tlv, stop + shift - curr, TLV_PAD);
+				if (curr >= stop + shift)
+					break;
+				tlv = tlvs->base + curr;
+			}
+			if (tlv->type != TLV_CHUNK)
+				tlvs->index[tlv->type] = curr;
+		}
+		hi += shift;
+		end = hi;
+	}
+
+	/* Padding run at the slot may be split by slack, keep what is left */
+	pos = tlvs_span_bound(tlvs, lo);
+	while (pos < tlvs->holes_cnt && tlvs->spans[pos].offset < hi)
+		tlvs_hole_remove(tlvs, tlvs_hole_at(tlvs, tlvs->spans[pos].offset));
+	tlvs_hole_insert(tlvs, end, hi - end);
+	return tlvs->base + lo;
+
+compact:
+	if (compacted || !tlvs->frag)
+		return NULL;
+	tlvs_compact(tlvs);
+	compacted = 1;
+	goto retry;
+}
+
+static struct tlv_field *tlvs_find(struct tlv_store *tlvs, uint8_t type)
+{
+	if (tlvs->index[type] < 0)
+		return NULL;
+
+	return tlvs->base + tlvs->index[type];
+}
+
+/* Staged deletion marker */
+static struct tlv_field tlvs_staged_del;
+
+/* Record as seen by readers, including changes staged by a transaction */
+static struct tlv_field *tlvs_lookup(struct tlv_store *tlvs, uint8_t type)
+{
+	struct tlv_field *tlv;
+
+	if (!tlvs->txn || !tlvs->txn->stage[type])
+		return tlvs_find(tlvs, type);
+
+	tlv = tlvs->txn->stage[type];
+	return tlv == &tlvs_staged_del ? NULL : tlv;
+}
+
+static void tlvs_unstage(struct tlv_store *tlvs, uint8_t type)
+{
+	if (tlvs->txn->stage[type] != &tlvs_staged_del)
+		free(tlvs->txn->stage[type]);
+	tlvs->txn->stage[type] = NULL;
+	free(tlvs->txn->large[type]);
+	tlvs->txn->large[type] = NULL;
+}
+
+static struct tlv_blob *tlvs_staged_large(struct tlv_store *tlvs, uint8_t type)
+{
+	return tlvs->txn ? tlvs->txn->large[type] : NULL;
+}
+
+static int tlvs_stage(struct tlv_store *tlvs, uint8_t type, uint16_t length, void *value)
+{
+	struct tlv_field *tlv;
+	size_t width = tlvs_hdr_need(tlvs, length);
+
+	/* Staged records use the storage record format */
+	tlv = malloc(width + length);
+	if (!tlv) {
+		perror("malloc() failed");
+		return -ENOMEM;
+	}
+
+	tlv_hdr_encode(tlvs->format, (uint8_t *)tlv, type, length, width);
+	memcpy((uint8_t *)tlv + width, value, length);
+
+	tlvs_unstage(tlvs, type);
+	tlvs->txn->stage[type] = tlv;
+	return 0;
+}
+
+static int tlvs_stage_large(struct tlv_store *tlvs, uint8_t type, size_t length, void *value)
+{
+	struct tlv_blob *blob;
+
+	blob = malloc(sizeof(*blob) + length);
+	if (!blob) {
+		perror("malloc() failed");
+		return -ENOMEM;
+	}
+
+	blob->length = length;
+	memcpy(blob->value, value, length);
+
+	/* Current head and chunks go away at commit */
+	tlvs_unstage(tlvs, type);
+	tlvs->txn->stage[type] = &tlvs_staged_del;
+	tlvs->txn->large[type] = blob;
+	return 0;
+}
+
+/* Pads out the record, turning it and its slack into a hole */
+static void tlvs_release(struct tlv_store *tlvs, struct tlv_field *tlv)
+{
+	size_t off = (void *)tlv - tlvs->base;
+	size_t len = tlvs_rec_len(tlvs, tlv), slack = 0;
+
+	if (tlv->type != TLV_CHUNK)
+		tlvs->index[tlv->type] = -1;
+	else if (tlvs_val_len(tlvs, tlv) >= sizeof(struct tlv_chunk))
+		tlvs->chunks[tlvs_val(tlvs, tlv)[0]]--;
+	/* Log record stays as is, superseded by a newer one */
+	if (tlvs->log) {
+		tlvs->frag += len;
+		return;
+	}
+	if (tlv->type != TLV_CHUNK && tlvs->reserve[tlv->type])
+		slack = tlvs_slack(tlvs, off + len);
+	tlvs_hole_insert(tlvs, off, len + slack);
+	tlvs_fill(tlvs, tlv, TLV_PAD, len);
+	tlvs->dirty = 1;
+}
+
+/* Places a new record whose value is the optional prefix followed by data */
+static int tlvs_add_rec(struct tlv_store *tlvs, uint8_t type, const void *prefix,
+			uint16_t plen, const void *value, uint16_t length)
+{
+	uint8_t hdr[TLV_VARINT_MAX + 1];
+	struct tlv_field *tlv;
+	size_t off, end, width, slack = 0, need = plen + length, trail = tlvs->trail;
+	const uint8_t *head;
+	uint32_t key;
+	int hold, ret;
+
+	/* Reserved capacity is claimed up front when there is room for it */
+	if (type != TLV_CHUNK && type != TLV_DEL && !tlvs->log && !tlvs->slack_hold &&
+	    tlvs->reserve[type] > need)
+		slack = tlvs->reserve[type] - need;
+
+	while (1) {
+		width = tlvs_hdr_need(tlvs, need + slack);
+		if (tlvs->sorted) {
+			/* Continuation owner and sequence lead the value */
+			head = plen ? prefix : value;
+			key = (uint32_t)type << 16;
+			if (type == TLV_CHUNK && need >= sizeof(struct tlv_chunk))
+				key |= head[0] << 8 | head[1];
+			tlv = tlvs_sorted_gap(tlvs, key, width + need + slack);
+		} else {
+			tlv = tlvs_gap(tlvs, width + need + trail + slack);
+			if (!tlv && tlvs->tail - tlvs->frag + width + need + trail + slack < tlvs->size) {
+				/* Enough space in total, only scattered across holes */
+				tlvs_compact(tlvs);
+				tlv = tlvs_gap(tlvs, width + need + trail + slack);
+			}
+		}
+		if (tlv || !slack)
+			break;
+		slack = 0;
+	}
+	if (!tlv && tlvs_slack_release(tlvs)) {
+		/* Compaction must not hand the released slack back */
+		hold = tlvs->slack_hold;
+		tlvs->slack_hold = 1;
+		ret = tlvs_add_rec(tlvs, type, prefix, plen, value, length);
+		tlvs->slack_hold = hold;
+		tlvs_slack_reclaim(tlvs, 0);
+		return ret;
+	}
+	if (!tlv)
+		return -ENOSPC;
+
+	tlv_hdr_encode(tlvs->format, hdr, type, need, width);
+	tlvs_write(tlvs, tlv, hdr, width);
+	if (plen)
+		tlvs_write(tlvs, (uint8_t *)tlv + width, prefix, plen);
+	tlvs_write(tlvs, (uint8_t *)tlv + width + plen, value, length);
+	if (trail)
+		tlvs_log_seal(tlvs, tlv);
+	if (slack && bspan_byte((uint8_t *)tlv + width + need, slack, TLV_PAD) < slack)
+		tlvs_fill(tlvs, (uint8_t *)tlv + width + need, TLV_PAD, slack);
+	tlvs->dirty = 1;
+
+	off = (void *)tlv - tlvs->base;
+	if (type == TLV_DEL)
+		tlvs->frag += width + need + trail;
+	else if (type != TLV_CHUNK)
+		tlvs->index[type] = off;
+	else if (need >= sizeof(struct tlv_chunk))
+		tlvs->chunks[tlvs_val(tlvs, tlv)[0]]++;
+	end = off + width + need + trail + slack;
+	if (end > tlvs->tail)
+		tlvs->tail = end;
+	TLV_DEBUG("New", tlv);
+	return 0;
+}
+
+static int tlvs_add_tail(struct tlv_store *tlvs, uint8_t type, uint16_t length, void *value)
+{
+	return tlvs_add_rec(tlvs, type, NULL, 0, value, length);
+}
+
+/*
+ * Walks continuation records of the type, optionally releasing them.
+ * Returns storage bytes they occupy.
+ */
+static size_t tlvs_chunks_walk(struct tlv_store *tlvs, uint8_t type, int release)
+{
+	struct tlv_field *tlv;
+	size_t curr = 0, len, total = 0;
+
+	if (!tlvs->chunks[type])
+		return 0;
+
+	while (curr < tlvs->tail) {
+		tlv = tlvs->base + curr;
+		if (tlv->type == TLV_PAD) {
+			curr += bspan_byte(tlv, tlvs->tail - curr, TLV_PAD);
+			continue;
+		}
+		if (tlv->type == TLV_EMPTY)
+			break;
+		len = tlvs_rec_len(tlvs, tlv);
+		if (tlv->type == TLV_CHUNK && tlvs_val_len(tlvs, tlv) >= sizeof(struct tlv_chunk) &&
+		    tlvs_val(tlvs, tlv)[0] == type &&
+		    (!tlvs->log || tlvs_log_live(tlvs, curr, tlv))) {
+			total += len;
+			if (release)
+				tlvs_release(tlvs, tlv);
+		}
+		curr += len;
+	}
+
+	return total;
+}
+
+/* Collects continuation records of the type in sequence order */
+static int tlvs_chunks_find(struct tlv_store *tlvs, uint8_t type, struct tlv_field **chunks)
+{
+	struct tlv_field *tlv;
+	struct tlv_chunk *chunk;
+	size_t curr = 0;
+	int cnt = 0;
+
+	if (!tlvs->chunks[type])
+		return 0;
+
+	memset(chunks, 0, TLV_CHUNKS_MAX * sizeof(*chunks));
+	while (curr < tlvs->tail) {
+		tlv = tlvs->base + curr;
+		if (tlv->type == TLV_PAD) {
+			curr += bspan_byte(tlv, tlvs->tail - curr, TLV_PAD);
+			continue;
+		}
+		if (tlv->type == TLV_EMPTY)
+			break;
+		chunk = (struct tlv_chunk *)tlvs_val(tlvs, tlv);
+		if (tlv->type == TLV_CHUNK && tlvs_val_len(tlvs, tlv) >= sizeof(*chunk) &&
+		    chunk->owner == type && chunk->seq && !chunks[chunk->seq - 1] &&
+		    (!tlvs->log || tlvs_log_live(tlvs, curr, tlv)))
+			chunks[chunk->seq - 1] = tlv;
+		curr += tlvs_rec_len(tlvs, tlv);
+	}
+
+	/* Value ends at the first missing chunk */
+	while (cnt < TLV_CHUNKS_MAX && chunks[cnt])
+		cnt++;
+
+	return cnt;
+}
+
+/* Storage needed for a value split into a head and continuation records */
+static size_t tlvs_large_need(struct tlv_store *tlvs, size_t length)
+{
+	size_t rest = length - TLV_HEAD_MAX;
+	size_t cnt = (rest + TLV_CHUNK_MAX - 1) / TLV_CHUNK_MAX;
+	size_t width = tlvs_hdr_need(tlvs, TLV_HEAD_MAX);
+
+	return width + length + cnt * (width + sizeof(struct tlv_chunk)) +
+	       (cnt + 1) * tlvs->trail;
+}
+
+int tlvs_add(struct tlv_store *tlvs, uint8_t type, uint16_t length, void *value)
+{
+	struct tlv_field *tlv;
+
+	assert(type != TLV_EMPTY && type != TLV_PAD &&
+	       type != TLV_CHUNK && type != TLV_DEL);
+
+	/* Storage that failed to read is not written over */
+	if (tlvs->fetch_err)
+		return -EIO;
+
+	tlv = tlvs_lookup(tlvs, type);
+	if (tlv || tlvs_staged_large(tlvs, type))
+		return -EEXIST;
+
+	if (tlvs->txn)
+		return tlvs_stage(tlvs, type, length, value);
+
+	tlvs_holes_sync(tlvs);
+	tlvs->stats.bytes_value += length;
+	return tlvs_add_tail(tlvs, type, length, value);
+}
+
+/*
+ * Extends record in place over the padding run or the free tail that
+ * directly follows it. Only the length field and the value are written.
+ */
+static int tlvs_grow(struct tlv_store *tlvs, struct tlv_field *tlv, uint16_t length, void *value)
+{
+	struct tlv_extent gap;
+	size_t off, end, extra, slack;
+	int idx;
+
+	/* Length must fit the current header, log is never rewritten */
+	if (tlvs->log || tlvs_hdr_need(tlvs, length) > tlvs_hdr_len(tlvs, tlv))
+		return -ENOSPC;
+
+	off = (void *)tlv - tlvs->base;
+	end = off + tlvs_rec_len(tlvs, tlv);
+	extra = length - tlvs_val_len(tlvs, tlv);
+
+	/* Own slack first, then whatever follows it */
+	slack = tlvs->reserve[tlv->type] ? tlvs_slack(tlvs, end) : 0;
+	if (extra <= slack) {
+		extra = 0;
+	} else {
+		end += slack;
+		extra -= slack;
+	}
+
+	if (!extra) {
+		tlvs->stats.set_slack++;
+	} else if (end == tlvs->tail) {
+		if (end + extra >= tlvs->size)
+			return -ENOSPC;
+		tlvs->tail = end + extra;
+	} else {
+		idx = tlvs_hole_at(tlvs, end);
+		if (idx < 0 || tlvs->holes[idx].length < extra)
+			return -ENOSPC;
+		gap = tlvs->holes[idx];
+		tlvs_hole_remove(tlvs, idx);
+		tlvs_hole_insert(tlvs, gap.offset + extra, gap.length - extra);
+	}
+
+	tlvs_write_len(tlvs, tlv, length);
+	tlvs_write(tlvs, tlvs_val(tlvs, tlv), value, length);
+	tlvs->dirty = 1;
+	tlvs_slack_claim(tlvs, tlv, 1);
+	return 0;
+}
+
+int tlvs_set(struct tlv_store *tlvs, uint8_t type, uint16_t length, void *value)
+{
+	struct tlv_field *tlv;
+	size_t dropped;
+	uint16_t flen;
+	int ret;
+
+	assert(type != TLV_EMPTY && type != TLV_PAD &&
+	       type != TLV_CHUNK && type != TLV_DEL);
+
+	if (tlvs->fetch_err)
+		return -EIO;
+
+	if (tlvs->txn)
+		return tlvs_stage(tlvs, type, length, value);
+
+	tlvs_holes_sync(tlvs);
+	tlvs->stats.bytes_value += length;
+
+	tlv = tlvs_find(tlvs, type);
+	dropped = tlvs_chunks_walk(tlvs, type, 0);
+
+	flen = tlv ? tlvs_val_len(tlvs, tlv) : 0;
+	if (tlv && !dropped && flen == length &&
+	    !tlvs_fetch(tlvs, tlvs_val(tlvs, tlv), length) &&
+	    !memcmp(tlvs_val(tlvs, tlv), value, length)) {
+		tlvs->stats.set_skip++;
+		return 0;
+	}
+
+	/* Log keeps the current value unless the new one fits after collection */
+	if (tlvs->log && tlvs_hdr_need(tlvs, length) + length + tlvs->trail >=
+	    tlvs->size - tlvs->tail + tlvs->frag + dropped + (tlv ? tlvs_rec_len(tlvs, tlv) : 0))
+		return -ENOSPC;
+
+	/* Value no longer needs continuation records */
+	if (dropped)
+		tlvs_chunks_walk(tlvs, type, 1);
+
+	if (!tlv)
+		return tlvs_add_tail(tlvs, type, length, value);
+
+	if (tlvs->log)
+		goto move;
 
-	assert(mem != NULL);
-	assert(len != 0);
+	if (flen == length) {
+		tlvs_write(tlvs, tlvs_val(tlvs, tlv), value, length);
+		tlvs->dirty = 1;
+		tlvs->stats.set_same++;
+		TLV_DEBUG("Set", tlv);
+		return 0;
+	}
 
-	tlvs = calloc(1, sizeof(*tlvs));
-	if (!tlvs) {
-		perror("calloc() failed");
-		return NULL;
+	if (flen > length) {
+		tlvs_write(tlvs, tlvs_val(tlvs, tlv), value, length);
+		tlvs_fill(tlvs, tlvs_val(tlvs, tlv) + length, TLV_PAD, flen - length);
+		tlvs_write_len(tlvs, tlv, length);
+		tlvs->dirty = 1;
+		tlvs_hole_insert(tlvs, tlvs->index[type] + tlvs_hdr_len(tlvs, tlv) + length,
+				 flen - length);
+		tlvs_slack_claim(tlvs, tlv, 0);
+		tlvs->stats.set_shrink++;
+		TLV_DEBUG("Set", tlv);
+		tlvs_autocompact(tlvs);
+		return 0;
 	}
 
-	tlvs->size = len;
-	tlvs->base = mem;
+	if (!tlvs_grow(tlvs, tlv, length, value)) {
+		tlvs->stats.set_grow++;
+		TLV_DEBUG("Grow", tlv);
+		return 0;
+	}
 
-	return tlvs;
+move:
+	tlvs->stats.set_move++;
+	tlvs_release(tlvs, tlv);
+	ret = tlvs_add_tail(tlvs, type, length, value);
+	tlvs_autocompact(tlvs);
+	return ret;
 }
 
-void tlvs_free(struct tlv_store *tlvs)
+/*
+ * Stores a value of any length up to TLV_CHUNKS_MAX continuation records.
+ * Values that fit a single record are stored by tlvs_set(), longer ones
+ * are split into a full head record of the type followed by TLV_CHUNK
+ * records carrying the owner type and sequence number.
+ */
+int tlvs_set_large(struct tlv_store *tlvs, uint8_t type, size_t length, void *value)
 {
-	free(tlvs);
+	struct tlv_field *tlv;
+	struct tlv_chunk chunk;
+	size_t off, len, avail;
+	int ret;
+
+	assert(type != TLV_EMPTY && type != TLV_PAD &&
+	       type != TLV_CHUNK && type != TLV_DEL);
+
+	if (tlvs->fetch_err)
+		return -EIO;
+
+	if (length <= TLV_HEAD_MAX)
+		return tlvs_set(tlvs, type, length, value);
+
+	if (length > TLV_HEAD_MAX + TLV_CHUNKS_MAX * TLV_CHUNK_MAX)
+		return -EFBIG;
+
+	if (tlvs->txn)
+		return tlvs_stage_large(tlvs, type, length, value);
+
+	tlvs_holes_sync(tlvs);
+	tlvs->stats.bytes_value += length;
+
+	avail = tlvs->size - tlvs->tail + tlvs->frag + tlvs_slack_total(tlvs) +
+		tlvs_chunks_walk(tlvs, type, 0);
+	tlv = tlvs_find(tlvs, type);
+	if (tlv)
+		avail += tlvs_rec_len(tlvs, tlv);
+	if (tlvs_large_need(tlvs, length) >= avail)
+		return -ENOSPC;
+
+	/* Log continuations are told apart by following the head */
+	tlvs_chunks_walk(tlvs, type, 1);
+	if (tlv)
+		tlvs_release(tlvs, tlv);
+
+	ret = tlvs_add_tail(tlvs, type, TLV_HEAD_MAX, value);
+
+	chunk.owner = type;
+	chunk.seq = 1;
+	for (off = TLV_HEAD_MAX; !ret && off < length; off += len) {
+		len = length - off < TLV_CHUNK_MAX ? length - off : TLV_CHUNK_MAX;
+		ret = tlvs_add_rec(tlvs, TLV_CHUNK, &chunk, sizeof(chunk), value + off, len);
+		chunk.seq++;
+	}
+
+	tlvs_autocompact(tlvs);
+	return ret;
 }
 
-void tlvs_reset(struct tlv_store *tlvs)
+int tlvs_del(struct tlv_store *tlvs, uint8_t type)
 {
-	memset(tlvs->base, TLV_EMPTY, tlvs->size);
+	struct tlv_field *tlv;
 
-	tlvs->dirty = 1;
+	assert(type != TLV_EMPTY && type != TLV_PAD &&
+	       type != TLV_CHUNK && type != TLV_DEL);
+
+	if (tlvs->fetch_err)
+		return -EIO;
+
+	tlv = tlvs_lookup(tlvs, type);
+	if (!tlv && !tlvs_staged_large(tlvs, type))
+		return -ENOENT;
+
+	if (tlvs->txn) {
+		tlvs_unstage(tlvs, type);
+		tlvs->txn->stage[type] = &tlvs_staged_del;
+		return 0;
+	}
+
+	TLV_DEBUG("Delete", tlv);
+	tlvs_holes_sync(tlvs);
+	tlvs_chunks_walk(tlvs, type, 1);
+	tlvs_release(tlvs, tlv);
+	/* Without room for a log marker, collection drops the record instead */
+	if (tlvs->log && tlvs_add_rec(tlvs, TLV_DEL, NULL, 0, &type, sizeof(type)))
+		tlvs_log_gc(tlvs);
+	tlvs_autocompact(tlvs);
+	return 0;
 }
 
-void tlvs_optimise(struct tlv_store *tlvs)
+int tlvs_begin(struct tlv_store *tlvs)
 {
-	struct tlv_field *tlv;
-	void *last, *curr, *save;
-	int count;
+	if (tlvs->txn)
+		return -EBUSY;
 
-	if (!tlvs->frag)
+	tlvs->txn = calloc(1, sizeof(*tlvs->txn));
+	if (!tlvs->txn) {
+		perror("calloc() failed");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* Points the store at another copy of its storage area */
+static void tlvs_area_move(struct tlv_store *tlvs, void *from, void *to)
+{
+	tlvs->base = to + (tlvs->base - from);
+	if (tlvs->log) {
+		tlvs->banks[0] = to + (tlvs->banks[0] - from);
+		tlvs->banks[1] = to + (tlvs->banks[1] - from);
+	}
+}
+
+/* Drops staged changes and changes placed by tlvs_prepare() */
+void tlvs_abort(struct tlv_store *tlvs)
+{
+	struct tlv_txn *txn = tlvs->txn;
+	int i;
+
+	if (!txn)
 		return;
 
-	save = tlvs->base;
-	curr = tlvs->base;
-	last = tlvs->base + tlvs->size;
+	for (i = 0; i < TLV_TYPES; i++)
+		tlvs_unstage(tlvs, i);
 
-	while ((curr + sizeof(struct tlv_field)) < last) {
-		tlv = curr;
-		if (tlv->type == TLV_EMPTY)
-			break;
-		/* Padding (holes) handling */
-		if (tlv->type == TLV_PAD) {
-			curr++;
-			continue;
+	if (txn->scratch) {
+		/* Storage was never written, only the state goes back */
+		tlvs_area_move(tlvs, txn->scratch, txn->area);
+		tlvs->stats = txn->stats;
+		tlvs->dirty = txn->dirty;
+		tlvs->crc_valid = txn->crc_valid;
+		tlvs->crc = txn->crc;
+		tlvs->crc_len = txn->crc_len;
+		if (tlvs->log) {
+			tlvs->bank = txn->bank;
+			tlvs->seq = txn->seq;
+			tlvs->base = tlvs->banks[txn->bank] + sizeof(struct tlv_log_bank);
 		}
-		count = ntohs(tlv->length) + sizeof(struct tlv_field);
-		if (save != curr) {
-			memcpy(save, curr, count);
-		}
-		save += count;
-		curr += count;
+		tlvs->slack_hold = 0;
+		tlvs_scan(tlvs);
+		tlvs_slack_reclaim(tlvs, 0);
+		free(txn->scratch);
 	}
 
-	if (save != curr)
-		memset(save, TLV_EMPTY, curr - save);
+	free(txn);
+	tlvs->txn = NULL;
+}
 
-	tlvs->dirty = 1;
+struct tlv_place {
+	struct tlv_field *stg;
+	uint16_t length;
+};
+
+static int tlvs_place_cmp(const void *a, const void *b)
+{
+	const struct tlv_place *pa = a;
+	const struct tlv_place *pb = b;
+
+	return (int)pb->length - (int)pa->length;
 }
 
-static struct tlv_field *tlvs_gap(struct tlv_store *tlvs, uint16_t length)
+/*
+ * Applies staged changes with a single layout pass: space released by
+ * deletions and shrinking records is reclaimed first, growing records are
+ * extended in place when possible, and the rest are placed largest first
+ * into best fitting holes. Storage is compacted only when the remaining
+ * records do not fit otherwise.
+ */
+static int tlvs_place(struct tlv_store *tlvs, struct tlv_txn *txn)
 {
-	void *last, *curr;
-	struct tlv_field *tlv = NULL;
-	struct tlv_field *gap = NULL;
-	size_t gap_len = 0, tmp_len;
+	struct tlv_field *tlv, *stg;
+	struct tlv_place queue[TLV_TYPES];
+	size_t avail, need = 0;
+	uint16_t flen, length;
+	int i, cnt = 0, ret = 0;
 
-	curr = tlvs->base;
-	last = tlvs->base + tlvs->size;
+	/* Slack is given up when a record does not fit otherwise */
+	avail = tlvs->size - tlvs->tail + tlvs->frag + tlvs_slack_total(tlvs);
 
-	while ((curr + sizeof(struct tlv_field)) < last) {
-		tlv = curr;
-		if (tlv->type == TLV_EMPTY) {
-			if (curr + sizeof(struct tlv_field) + length >= last)
-				tlv = NULL;
-			break;
+	for (i = 0; i < TLV_TYPES; i++) {
+		stg = txn->stage[i];
+		if (!stg)
+			continue;
+		/* Any change drops continuation records of the type */
+		avail += tlvs_chunks_walk(tlvs, i, 0);
+		if (txn->large[i])
+			need += tlvs_large_need(tlvs, txn->large[i]->length);
+		tlv = tlvs_find(tlvs, i);
+		flen = tlv ? tlvs_val_len(tlvs, tlv) : 0;
+		if (stg == &tlvs_staged_del) {
+			if (tlv)
+				avail += tlvs_rec_len(tlvs, tlv);
+			/* Log keeps a deletion marker */
+			if (tlv && tlvs->log)
+				need += tlvs_hdr_need(tlvs, 1) + 1 + tlvs->trail;
+			continue;
 		}
-		if (tlv->type == TLV_PAD) {
-			while (curr < last && ((struct tlv_field *)curr)->type == TLV_PAD)
-				curr++;
-			if (curr == last) {
-				tlv = NULL;
-				break;
-			}
-			tmp_len = (curr - (void *)tlv) - sizeof(struct tlv_field);
-			if ((tmp_len >= length) &&
-			    (!gap || tmp_len < gap_len)) {
-				gap = tlv;
-				gap_len = tmp_len;
-			}
-			if (gap_len == length)
-				break;
+		length = tlvs_val_len(tlvs, stg);
+		/* Log never shrinks in place */
+		if (tlv && flen >= length && !tlvs->log) {
+			avail += flen - length;
 			continue;
 		}
-		curr += ntohs(tlv->length) + sizeof(struct tlv_field);
+		if (tlv)
+			avail += tlvs_rec_len(tlvs, tlv);
+		need += tlvs_rec_len(tlvs, stg);
 	}
 
-	return gap ? gap : tlv;
-}
+	if (need && need >= avail)
+		return -ENOSPC;
 
-static struct tlv_field *tlvs_find(struct tlv_store *tlvs, uint8_t type)
-{
-	void *last, *curr;
-	struct tlv_field *tlv;
+	/* Placement must not lose space to reservations, see below */
+	tlvs->slack_hold = 1;
 
-	curr = tlvs->base;
-	last = tlvs->base + tlvs->size;
+	/* Release space: deletions and updates that fit in place */
+	for (i = 0; i < TLV_TYPES; i++) {
+		stg = txn->stage[i];
+		if (stg)
+			tlvs_chunks_walk(tlvs, i, 1);
+		tlv = tlvs_find(tlvs, i);
+		if (!stg || !tlv)
+			continue;
+		if (stg == &tlvs_staged_del)
+			tlvs_del(tlvs, i);
+		else if (tlvs_val_len(tlvs, tlv) >= tlvs_val_len(tlvs, stg))
+			tlvs_set(tlvs, i, tlvs_val_len(tlvs, stg), tlvs_val(tlvs, stg));
+	}
 
-	while ((curr + sizeof(struct tlv_field)) < last) {
-		tlv = curr;
-		if (tlv->type == type)
-			return tlv;
-		if (tlv->type == TLV_EMPTY)
-			break;
-		/* Padding (holes) handling */
-		if (tlv->type == TLV_PAD) {
-			curr++;
+	/* Grow in place when possible, otherwise queue for placement */
+	for (i = 0; i < TLV_TYPES; i++) {
+		stg = txn->stage[i];
+		if (!stg || stg == &tlvs_staged_del)
+			continue;
+		tlv = tlvs_find(tlvs, i);
+		length = tlvs_val_len(tlvs, stg);
+		if (tlv && tlvs_val_len(tlvs, tlv) >= length)
 			continue;
+		if (tlv && !tlvs_grow(tlvs, tlv, length, tlvs_val(tlvs, stg))) {
+			tlvs->stats.set_grow++;
+			continue;
+		}
+		if (tlv) {
+			tlvs->stats.set_move++;
+			tlvs_release(tlvs, tlv);
 		}
-		curr += ntohs(tlv->length) + sizeof(struct tlv_field);
+		queue[cnt].stg = stg;
+		queue[cnt++].length = length;
 	}
 
-	return NULL;
+	qsort(queue, cnt, sizeof(*queue), tlvs_place_cmp);
+
+	for (i = 0; i < cnt; i++) {
+		stg = queue[i].stg;
+		tlvs->stats.bytes_value += queue[i].length;
+		ret = tlvs_add_tail(tlvs, stg->type, queue[i].length, tlvs_val(tlvs, stg));
+		if (ret)
+			break;
+	}
+
+	/* Long values go last, split across the remaining space */
+	for (i = 0; !ret && i < TLV_TYPES; i++) {
+		if (txn->large[i])
+			ret = tlvs_set_large(tlvs, i, txn->large[i]->length,
+					     txn->large[i]->value);
+	}
+
+	tlvs->slack_hold = 0;
+	tlvs_slack_reclaim(tlvs, 0);
+	for (i = 0; i < TLV_TYPES; i++) {
+		tlv = tlvs_find(tlvs, i);
+		if (txn->stage[i] && tlv)
+			tlvs_slack_claim(tlvs, tlv, 1);
+	}
+
+	return ret;
 }
 
-static int tlvs_add_tail(struct tlv_store *tlvs, uint8_t type, uint16_t length, void *value)
+/*
+ * Places staged changes in a copy of the storage area, which the store
+ * reads from until tlvs_commit() writes it over the storage or
+ * tlvs_abort() drops it. Changes staged after it are placed by the next
+ * call. A transaction that does not fit is aborted with the storage
+ * untouched.
+ */
+int tlvs_prepare(struct tlv_store *tlvs)
 {
-	struct tlv_field *tlv;
+	struct tlv_txn *txn = tlvs->txn;
+	void *area;
+	size_t len;
+	int i, ret;
 
-	tlv = tlvs_gap(tlvs, length);
-	if (!tlv)
-		return -ENOSPC;
+	if (!txn)
+		return -EINVAL;
+	if (tlvs->fetch_err)
+		return -EIO;
 
-	tlv->type = type;
-	tlv->length = htons(length);
-	memcpy(tlv->value, value, length);
-	tlvs->dirty = 1;
-	TLV_DEBUG("New", tlv);
-	return 0;
+	tlvs_holes_sync(tlvs);
+	if (!txn->scratch) {
+		area = tlvs->log ? tlvs->banks[0] : tlvs->base;
+		len = tlvs->log ? 2 * tlvs->bank_size : tlvs->size;
+		if (tlvs_fetch(tlvs, area, len))
+			return -EIO;
+		txn->scratch = malloc(len);
+		if (!txn->scratch) {
+			perror("malloc() failed");
+			return -ENOMEM;
+		}
+		memcpy(txn->scratch, area, len);
+		txn->area = area;
+		txn->area_len = len;
+		txn->stats = tlvs->stats;
+		txn->dirty = tlvs->dirty;
+		txn->crc_valid = tlvs->crc_valid;
+		txn->crc = tlvs->crc;
+		txn->crc_len = tlvs->crc_len;
+		txn->bank = tlvs->bank;
+		txn->seq = tlvs->seq;
+		tlvs_area_move(tlvs, area, txn->scratch);
+	}
+
+	/* Changes are applied to the copy from now on */
+	tlvs->txn = NULL;
+	ret = tlvs_place(tlvs, txn);
+	tlvs->txn = txn;
+	for (i = 0; i < TLV_TYPES; i++)
+		tlvs_unstage(tlvs, i);
+
+	if (ret)
+		tlvs_abort(tlvs);
+	return ret;
 }
 
-int tlvs_add(struct tlv_store *tlvs, uint8_t type, uint16_t length, void *value)
+/*
+ * Places staged changes and writes them to the storage, nothing is
+ * written unless all changes fit.
+ */
+int tlvs_commit(struct tlv_store *tlvs)
 {
-	struct tlv_field *tlv;
+	struct tlv_txn *txn = tlvs->txn;
+	size_t written;
+	int ret;
 
-	assert(type != TLV_EMPTY && type != TLV_PAD);
+	ret = tlvs_prepare(tlvs);
+	if (ret)
+		return ret;
 
-	tlv = tlvs_find(tlvs, type);
-	if (tlv)
-		return -EEXIST;
+	/* Only bytes that differ reach the storage */
+	written = bcopy_diff(txn->area, txn->scratch, txn->area_len);
+	tlvs_area_move(tlvs, txn->scratch, txn->area);
+	free(txn->scratch);
+	free(txn);
+	tlvs->txn = NULL;
 
-	return tlvs_add_tail(tlvs, type, length, value);
+	/* Unchanged storage is left as it is */
+	if (written)
+		tlvs_autocompact(tlvs);
+	return 0;
 }
 
-int tlvs_set(struct tlv_store *tlvs, uint8_t type, uint16_t length, void *value)
+struct tlv_order {
+	uint32_t key;
+	size_t offset;
+};
+
+static int tlvs_order_cmp(const void *a, const void *b)
+{
+	const struct tlv_order *oa = a;
+	const struct tlv_order *ob = b;
+
+	if (oa->key != ob->key)
+		return oa->key < ob->key ? -1 : 1;
+	return oa->offset < ob->offset ? -1 : oa->offset > ob->offset;
+}
+
+/*
+ * Rewrites all records densely in the given record format, in storage
+ * order or ordered by key in sorted mode. Records shadowed by an earlier
+ * one of the same type are dropped. Reserved records get their slack
+ * back only once all records are placed. Storage is restored when the
+ * records do not fit.
+ */
+static int tlvs_rebuild(struct tlv_store *tlvs, int format)
 {
 	struct tlv_field *tlv;
+	struct tlv_order *order;
+	size_t curr, len, need = 0;
+	int i, cnt = 0, ret = 0, old = tlvs->format;
+	uint8_t *copy;
 
-	assert(type != TLV_EMPTY && type != TLV_PAD);
+	if (tlvs->txn)
+		return -EBUSY;
+	if (tlvs->log)
+		return -EOPNOTSUPP;
 
-	tlv = tlvs_find(tlvs, type);
-	if (!tlv)
-		return tlvs_add_tail(tlvs, type, length, value);
+	len = tlvs->tail;
+	/* Whole storage, to restore it as it was */
+	copy = malloc(tlvs->size);
+	/* No record is shorter than its header */
+	order = malloc((len / tlvs->hdr_min + 1) * sizeof(*order));
+	if (!copy || !order) {
+		perror("malloc() failed");
+		free(copy);
+		free(order);
+		return -ENOMEM;
+	}
+	if (tlvs_fetch(tlvs, tlvs->base, tlvs->size)) {
+		free(copy);
+		free(order);
+		return -EIO;
+	}
+	memcpy(copy, tlvs->base, tlvs->size);
 
-	if (ntohs(tlv->length) == length) {
-		memcpy(tlv->value, value, length);
-		tlvs->dirty = 1;
-		TLV_DEBUG("Set", tlv);
-		return 0;
+	curr = 0;
+	while (curr + tlvs->hdr_min <= len) {
+		tlv = (struct tlv_field *)(copy + curr);
+		if (tlv->type == TLV_PAD) {
+			curr += bspan_byte(tlv, len - curr, TLV_PAD);
+			continue;
+		}
+		order[cnt].key = tlv_key(old, tlv);
+		order[cnt++].offset = curr;
+		need += tlv_hdr_need(format, tlv_val_len(old, tlv)) + tlv_val_len(old, tlv);
+		curr += tlv_hdr_len(old, tlv) + tlv_val_len(old, tlv);
+	}
+
+	if (need + tlv_hdr_need(format, 0) >= tlvs->size) {
+		free(copy);
+		free(order);
+		return -ENOSPC;
 	}
 
-	tlvs->frag = 1;
+	if (tlvs->sorted)
+		qsort(order, cnt, sizeof(*order), tlvs_order_cmp);
 
-	memset(tlv->value, TLV_PAD, ntohs(tlv->length));
-	if (tlv->length > length) {
-		memcpy(tlv->value, value, length);
-		tlv->length = htons(length);
-		tlvs->dirty = 1;
-		TLV_DEBUG("Set", tlv);
-		return 0;
-	} else if (tlv->length < length) {
-		memset(tlv, TLV_PAD, sizeof(*tlv));
-		return tlvs_add_tail(tlvs, type, length, value);
+	tlvs->format = format;
+	tlvs->hdr_min = tlv_hdr_need(format, 0);
+	tlvs_reset(tlvs);
+
+	tlvs->slack_hold = 1;
+	for (i = 0; !ret && i < cnt; i++) {
+		tlv = (struct tlv_field *)(copy + order[i].offset);
+		if (tlv->type == TLV_CHUNK || tlvs->index[tlv->type] < 0)
+			ret = tlvs_add_rec(tlvs, tlv->type, NULL, 0, (uint8_t *)tlv +
+					   tlv_hdr_len(old, tlv), tlv_val_len(old, tlv));
 	}
-}
+	tlvs->slack_hold = 0;
 
-int tlvs_del(struct tlv_store *tlvs, uint8_t type)
-{
-	struct tlv_field *tlv;
+	if (ret) {
+		tlvs_write(tlvs, tlvs->base, copy, tlvs->size);
+		tlvs->format = old;
+		tlvs->hdr_min = tlv_hdr_need(old, 0);
+		tlvs_scan(tlvs);
+	} else {
+		tlvs_slack_reclaim(tlvs, 1);
+	}
 
-	assert(type != TLV_EMPTY && type != TLV_PAD);
+	free(copy);
+	free(order);
+	return ret;
+}
 
-	tlv = tlvs_find(tlvs, type);
-	if (!tlv)
-		return -ENOENT;
+/* Rewrites all records in another record format, keeping their order */
+int tlvs_convert(struct tlv_store *tlvs, int format)
+{
+	if (format == tlvs->format)
+		return 0;
 
-	tlvs->frag = 1;
-	tlvs->dirty = 1;
-	memset(tlv, TLV_PAD, sizeof(*tlv) + ntohs(tlv->length));
-	TLV_DEBUG("Delete", tlv);
-	return 0;
+	return tlvs_rebuild(tlvs, format);
 }
 
 size_t tlvs_len(struct tlv_store *tlvs)
 {
-	void *item;
-
-	item = tlvs_find(tlvs, TLV_EMPTY);
-	if (item) {
-		return item - tlvs->base;
-	} else {
-		return tlvs->size;
-	}
+	return tlvs->tail;
 }
 
 ssize_t tlvs_get(struct tlv_store *tlvs, uint8_t type, int len, char *buf)
@@ -246,16 +2087,18 @@ ssize_t tlvs_get(struct tlv_store *tlvs, uint8_t type, int len, char *buf)
 	struct tlv_field *tlv;
 	int cnt, flen;
 
-	tlv = tlvs_find(tlvs, type);
+	tlv = tlvs_lookup(tlvs, type);
 	if (!tlv)
 		return -1;
 
-	flen = ntohs(tlv->length);
+	flen = tlvs_val_len(tlvs, tlv);
 	if (!buf)
 		return flen;
 
 	cnt = len < flen ? len : flen;
-	memcpy(buf, tlv->value, cnt);
+	if (tlvs_fetch(tlvs, tlvs_val(tlvs, tlv), cnt))
+		return -1;
+	memcpy(buf, tlvs_val(tlvs, tlv), cnt);
 	/* ASCII termination when tailroom is available */
 	if (len > flen)
 		buf[flen] = '\0';
@@ -263,29 +2106,133 @@ ssize_t tlvs_get(struct tlv_store *tlvs, uint8_t type, int len, char *buf)
 	return cnt;
 }
 
+int tlvs_view(struct tlv_store *tlvs, uint8_t type, struct tlv_view *view)
+{
+	struct tlv_field *tlv;
+
+	tlv = tlvs_lookup(tlvs, type);
+	if (!tlv)
+		return -ENOENT;
+
+	view->data = tlvs_val(tlvs, tlv);
+	view->len = tlvs_val_len(tlvs, tlv);
+
+	return tlvs_fetch(tlvs, view->data, view->len) ? -EIO : 0;
+}
+
+/* Full value length, including continuation records */
+ssize_t tlvs_size(struct tlv_store *tlvs, uint8_t type)
+{
+	struct tlv_field *tlv, *chunks[TLV_CHUNKS_MAX];
+	struct tlv_blob *blob;
+	ssize_t len;
+	int i, cnt;
+
+	blob = tlvs_staged_large(tlvs, type);
+	if (blob)
+		return blob->length;
+
+	tlv = tlvs_lookup(tlvs, type);
+	if (!tlv)
+		return -1;
+
+	len = tlvs_val_len(tlvs, tlv);
+	if (tlv != tlvs_find(tlvs, type))
+		return len;
+
+	cnt = tlvs_chunks_find(tlvs, type, chunks);
+	for (i = 0; i < cnt; i++)
+		len += tlvs_val_len(tlvs, chunks[i]) - sizeof(struct tlv_chunk);
+
+	return len;
+}
+
+/*
+ * Passes the value to the callback piece by piece in storage, head record
+ * first, without assembling it. Stops on the first non-zero callback
+ * return and passes it on.
+ */
+int tlvs_read_chunks(struct tlv_store *tlvs, uint8_t type, tlv_chunk_cb_t cb, void *arg)
+{
+	struct tlv_field *tlv, *chunks[TLV_CHUNKS_MAX];
+	struct tlv_blob *blob;
+	int i, cnt, ret;
+
+	blob = tlvs_staged_large(tlvs, type);
+	if (blob)
+		return cb(arg, blob->value, blob->length);
+
+	tlv = tlvs_lookup(tlvs, type);
+	if (!tlv)
+		return -ENOENT;
+
+	if (tlvs_fetch(tlvs, tlvs_val(tlvs, tlv), tlvs_val_len(tlvs, tlv)))
+		return -EIO;
+	ret = cb(arg, tlvs_val(tlvs, tlv), tlvs_val_len(tlvs, tlv));
+	if (ret || tlv != tlvs_find(tlvs, type))
+		return ret;
+
+	cnt = tlvs_chunks_find(tlvs, type, chunks);
+	for (i = 0; !ret && i < cnt; i++) {
+		if (tlvs_fetch(tlvs, tlvs_val(tlvs, chunks[i]), tlvs_val_len(tlvs, chunks[i])))
+			return -EIO;
+		ret = cb(arg, tlvs_val(tlvs, chunks[i]) + sizeof(struct tlv_chunk),
+			 tlvs_val_len(tlvs, chunks[i]) - sizeof(struct tlv_chunk));
+	}
+
+	return ret;
+}
+
 void tlvs_dump(struct tlv_store *tlvs)
 {
 	struct tlv_iterator iter;
 	struct tlv_field *tlv;
-	int i;
+	const uint8_t *val;
+	size_t i;
 
 	tlvs_iter_init(&iter, tlvs);
 
 	while ((tlv = tlvs_iter_next(&iter)) != NULL) {
+		val = iter.view.data;
 		printf("TLV[%x] data # %i @ 0x%02lx: ", TLV_PROPS(tlv));
-		for (i = 0; i < ntohs(tlv->length); i++) {
-			printf("0x%02x ", tlv->value[i]);
+		for (i = 0; i < iter.view.len; i++) {
+			printf("0x%02x ", val[i]);
 		}
 		printf("| ");
-		for (i = 0; i < ntohs(tlv->length); i++) {
-			printf("%c", (tlv->value[i] > 31 &&
-				      tlv->value[i] < 127) ?
-			       tlv->value[i] : '.');
+		for (i = 0; i < iter.view.len; i++) {
+			printf("%c", (val[i] > 31 &&
+				      val[i] < 127) ?
+			       val[i] : '.');
 		}
 		printf("\n");
 	}
 }
 
+/* Seeds CRC tracking with known crc_32() of the first len bytes */
+void tlvs_crc_init(struct tlv_store *tlvs, uint32_t crc, size_t len)
+{
+	tlvs->crc = crc;
+	tlvs->crc_len = len;
+	tlvs->crc_valid = 1;
+}
+
+/* Returns crc_32() of the used storage area, see tlvs_len() */
+uint32_t tlvs_crc(struct tlv_store *tlvs)
+{
+	size_t len = tlvs_len(tlvs);
+
+	tlvs_fetch(tlvs, tlvs->base, len);
+	if (!tlvs->crc_valid || len < tlvs->crc_len)
+		tlvs->crc = crc_32(tlvs->base, len);
+	else if (len > tlvs->crc_len)
+		tlvs->crc = crc32_update(tlvs->crc, tlvs->base + tlvs->crc_len,
+					 len - tlvs->crc_len);
+
+	tlvs_crc_init(tlvs, tlvs->crc, len);
+
+	return tlvs->crc;
+}
+
 void tlvs_iter_init(struct tlv_iterator *iter, struct tlv_store *tlvs)
 {
 	if (!iter || !tlvs)
@@ -293,6 +2240,59 @@ void tlvs_iter_init(struct tlv_iterator *iter, struct tlv_store *tlvs)
 
 	iter->tlvs = tlvs;
 	iter->curr = tlvs->base;
+	iter->type = -1;
+}
+
+/* Iterates records of types first..last through the index, absent types cost nothing */
+void tlvs_iter_init_range(struct tlv_iterator *iter, struct tlv_store *tlvs,
+			  uint8_t first, uint8_t last)
+{
+	if (!iter || !tlvs)
+		return;
+
+	iter->tlvs = tlvs;
+	iter->curr = NULL;
+	iter->type = first;
+	iter->last = last;
+	iter->types = NULL;
+}
+
+/* Iterates records of types set in the map, bit (1 << type % 8) of byte type / 8 */
+void tlvs_iter_init_types(struct tlv_iterator *iter, struct tlv_store *tlvs,
+			  const uint8_t *types)
+{
+	tlvs_iter_init_range(iter, tlvs, 0, TLV_TYPES - 1);
+	if (iter)
+		iter->types = types;
+}
+
+static struct tlv_field *tlvs_iter_next_type(struct tlv_iterator *iter)
+{
+	struct tlv_field *tlv;
+	int type;
+
+	while (iter->type <= iter->last) {
+		type = iter->type++;
+		if (iter->types && !(iter->types[type / 8] & 1 << type % 8)) {
+			/* Empty bytes of the map are skipped at once */
+			if (!iter->types[type / 8])
+				iter->type = (type | 7) + 1;
+			continue;
+		}
+
+		/* Changes staged by a transaction are seen, same as tlvs_view() */
+		tlv = tlvs_lookup(iter->tlvs, type);
+		if (!tlv)
+			continue;
+
+		iter->view.data = tlvs_val(iter->tlvs, tlv);
+		iter->view.len = tlvs_val_len(iter->tlvs, tlv);
+		if (tlvs_fetch(iter->tlvs, iter->view.data, iter->view.len))
+			return NULL;
+		return tlv;
+	}
+
+	return NULL;
 }
 
 struct tlv_field *tlvs_iter_next(struct tlv_iterator *iter)
@@ -303,21 +2303,37 @@ struct tlv_field *tlvs_iter_next(struct tlv_iterator *iter)
 	if (!iter)
 		return NULL;
 
-	last = iter->tlvs->base + iter->tlvs->size;
+	if (iter->type >= 0)
+		return tlvs_iter_next_type(iter);
+
+	/* Records end before the tail, the scan bounds them by the storage */
+	last = iter->tlvs->base + iter->tlvs->tail;
 
-	while ((iter->curr + sizeof(struct tlv_field)) < last) {
+	while (iter->curr + iter->tlvs->hdr_min <= last) {
 		tlv = iter->curr;
 		/* End of TLV storage */
 		if (tlv->type == TLV_EMPTY)
 			return NULL;
 		/* Padding (holes) handling */
 		if (tlv->type == TLV_PAD) {
-			iter->curr++;
+			iter->curr += bspan_byte(tlv, last - iter->curr, TLV_PAD);
 			continue;
 		}
+		/* Continuation records are part of the head record value */
+		if (tlv->type == TLV_CHUNK ||
+		    (iter->tlvs->log &&
+		     !tlvs_log_live(iter->tlvs, iter->curr - iter->tlvs->base, tlv))) {
+			iter->curr += tlvs_rec_len(iter->tlvs, tlv);
+			continue;
+		}
+
+		iter->view.data = tlvs_val(iter->tlvs, tlv);
+		iter->view.len = tlvs_val_len(iter->tlvs, tlv);
+		if (tlvs_fetch(iter->tlvs, iter->view.data, iter->view.len))
+			return NULL;
 
 		/* Move cursor to next entry for subsequent calls */
-		iter->curr += ntohs(tlv->length) + sizeof(struct tlv_field);
+		iter->curr += tlvs_rec_len(iter->tlvs, tlv);
 
 		return tlv;
 	}
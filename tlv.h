@@ -10,30 +10,192 @@ struct __attribute__ ((__packed__)) tlv_field {
         uint8_t value[0];
 };
 
+/* Value of a continuation record, following the head record of the type */
+struct __attribute__ ((__packed__)) tlv_chunk {
+	uint8_t owner;
+	uint8_t seq;
+	uint8_t data[0];
+};
+
+#define TLV_TYPES 256
+
+/* Record header formats */
+#define TLV_FORMAT_V1 1		/* type, 16-bit big endian length */
+#define TLV_FORMAT_V2 2		/* type, varint length */
+#define TLV_HEAD_MAX 0xFFFF
+#define TLV_CHUNK_MAX (0xFFFF - sizeof(struct tlv_chunk))
+#define TLV_CHUNKS_MAX 255
+
+struct tlv_extent {
+	size_t offset;
+	size_t length;
+};
+
+struct tlv_stats {
+	unsigned int set_skip;		/* value unchanged, nothing written */
+	unsigned int set_same;		/* rewritten with the same length */
+	unsigned int set_shrink;	/* shrunk in place */
+	unsigned int set_grow;		/* grown in place */
+	unsigned int set_slack;		/* grown within reserved capacity */
+	unsigned int set_move;		/* relocated to a new place */
+	unsigned int compact;		/* compaction passes */
+	unsigned int erase;		/* log banks erased */
+	unsigned long bytes_value;	/* value bytes stored by callers */
+	unsigned long bytes_written;	/* bytes written to the storage */
+};
+
+struct tlv_blob {
+	size_t length;
+	uint8_t value[0];
+};
+
+/* Staged records of an open transaction, indexed by type */
+struct tlv_txn {
+	struct tlv_field *stage[TLV_TYPES];
+	/* Values longer than TLV_HEAD_MAX, applied last */
+	struct tlv_blob *large[TLV_TYPES];
+	/* Copy of the storage area changes are placed in, see tlvs_prepare() */
+	void *scratch;
+	void *area;
+	size_t area_len;
+	/* Store state before placement, restored when the copy is dropped */
+	struct tlv_stats stats;
+	int dirty;
+	int crc_valid;
+	uint32_t crc;
+	size_t crc_len;
+	int bank;
+	uint32_t seq;
+};
+
+/*
+ * Reads len bytes at addr before the store uses them, set for storage
+ * paged from a slow device. Returns 0 or -1 when the device read failed.
+ */
+typedef int (*tlv_fetch_cb_t)(void *arg, const void *addr, size_t len);
+
 struct tlv_store {
 	size_t size;
 	void *base;
-	int frag;
+	int format;
+	/* Shortest record header, less free space is not usable */
+	size_t hdr_min;
+	/* Records kept ordered by type */
+	int sorted;
+	/*
+	 * Append-only log of two banks, base points into the active one.
+	 * Index follows the newest record of each type, frag counts bytes
+	 * of superseded records.
+	 */
+	int log;
+	/* Log records end with a CRC-16 of header and value, 0 otherwise */
+	size_t trail;
+	void *banks[2];
+	size_t bank_size;
+	int bank;
+	uint32_t seq;
+	/* Padding bytes tracked in the holes map */
+	size_t frag;
 	int dirty;
+	/* Offset of the first TLV_EMPTY byte (end of data) */
+	size_t tail;
+	/* Record offset per type, -1 when type is not stored */
+	ssize_t index[TLV_TYPES];
+	/* Continuation record count per owner type */
+	uint16_t chunks[TLV_TYPES];
+	/*
+	 * Value capacity reserved per type. Padding directly after such a
+	 * record is kept as its slack for in place growth, not as a hole.
+	 */
+	uint16_t reserve[TLV_TYPES];
+	/* Slack is claimed after commit placement, not during it */
+	int slack_hold;
+	/* Padding runs (holes) ordered by length, then by offset */
+	struct tlv_extent *holes;
+	/* Same runs ordered by offset */
+	struct tlv_extent *spans;
+	int holes_cnt;
+	int holes_max;
+	/* Runs left untracked when memory was short, rescan before use */
+	int holes_stale;
+	/* Compact once frag exceeds the limit (0 disables), budget bytes per pass */
+	size_t frag_limit;
+	size_t compact_budget;
+	struct tlv_stats stats;
+	/* CRC of [0, crc_len), kept up to date on every write when valid */
+	int crc_valid;
+	uint32_t crc;
+	size_t crc_len;
+	struct tlv_txn *txn;
+	/* Paged storage, headers are read along the record chain, values on use */
+	tlv_fetch_cb_t fetch;
+	void *fetch_arg;
+	/* Storage read failed, changes are refused */
+	int fetch_err;
+};
+
+/* Borrowed reference into the storage, valid until next modification */
+struct tlv_view {
+	const void *data;
+	size_t len;
 };
 
+typedef int (*tlv_chunk_cb_t)(void *arg, const void *data, size_t len);
+
 struct tlv_iterator {
 	struct tlv_store *tlvs;
 	void *curr;
+	/*
+	 * Type filter: next type to visit (-1 walks the whole storage), last
+	 * type and optional map of TLV_TYPES bits. Filtered walk goes through
+	 * the index in type order.
+	 */
+	int type;
+	int last;
+	const uint8_t *types;
+	/* Value of the record last returned */
+	struct tlv_view view;
 };
 
 struct tlv_store *tlvs_init(void *mem, int len);
+struct tlv_store *tlvs_init_format(void *mem, int len, int format);
+struct tlv_store *tlvs_init_log(void *mem, int len, int format);
+struct tlv_store *tlvs_init_paged(void *mem, int len, int format,
+				  tlv_fetch_cb_t fetch, void *arg);
+struct tlv_store *tlvs_init_log_paged(void *mem, int len, int format,
+				      tlv_fetch_cb_t fetch, void *arg);
+struct tlv_store *tlvs_init_nested(struct tlv_store *tlvs, const struct tlv_view *view);
+void tlvs_rebase(struct tlv_store *tlvs, void *mem);
+int tlvs_convert(struct tlv_store *tlvs, int format);
 void tlvs_free(struct tlv_store *tlvs);
 void tlvs_reset(struct tlv_store *tlvs);
 void tlvs_optimise(struct tlv_store *tlvs);
+void tlvs_set_sorted(struct tlv_store *tlvs, int sorted);
+size_t tlvs_optimise_step(struct tlv_store *tlvs, size_t budget);
+void tlvs_compact_policy(struct tlv_store *tlvs, size_t frag_limit, size_t budget);
+void tlvs_reserve(struct tlv_store *tlvs, uint8_t type, uint16_t capacity);
 int tlvs_add(struct tlv_store *tlvs, uint8_t type, uint16_t length, void *value);
 int tlvs_set(struct tlv_store *tlvs, uint8_t type, uint16_t length, void *value);
+int tlvs_set_large(struct tlv_store *tlvs, uint8_t type, size_t length, void *value);
 int tlvs_del(struct tlv_store *tlvs, uint8_t type);
+ssize_t tlvs_size(struct tlv_store *tlvs, uint8_t type);
+int tlvs_read_chunks(struct tlv_store *tlvs, uint8_t type, tlv_chunk_cb_t cb, void *arg);
 size_t tlvs_len(struct tlv_store *tlvs);
 ssize_t tlvs_get(struct tlv_store *tlvs, uint8_t type, int len, char *buf);
+int tlvs_view(struct tlv_store *tlvs, uint8_t type, struct tlv_view *view);
 void tlvs_dump(struct tlv_store *tlvs);
+int tlvs_begin(struct tlv_store *tlvs);
+int tlvs_prepare(struct tlv_store *tlvs);
+int tlvs_commit(struct tlv_store *tlvs);
+void tlvs_abort(struct tlv_store *tlvs);
+void tlvs_crc_init(struct tlv_store *tlvs, uint32_t crc, size_t len);
+uint32_t tlvs_crc(struct tlv_store *tlvs);
 
 void tlvs_iter_init(struct tlv_iterator *iter, struct tlv_store *tlvs);
+void tlvs_iter_init_range(struct tlv_iterator *iter, struct tlv_store *tlvs,
+			  uint8_t first, uint8_t last);
+void tlvs_iter_init_types(struct tlv_iterator *iter, struct tlv_store *tlvs,
+			  const uint8_t *types);
 struct tlv_field *tlvs_iter_next(struct tlv_iterator *iter);
 
 #endif /* __TLV_STORE_H */
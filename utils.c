@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -202,13 +203,156 @@ char *bcopy_text(char *src, size_t len)
 	return buf;
 }
 
+/*
+ * Look up option in comma separated "name[=value],..." list. Returns
+ * pointer to the value (empty string for bare flags) or NULL.
+ */
+const char *sopt_find(const char *opts, const char *name)
+{
+	size_t len = strlen(name);
+	const char *pos = opts;
+
+	while (pos && *pos) {
+		if (!strncmp(pos, name, len)) {
+			if (pos[len] == '=')
+				return pos + len + 1;
+			if (pos[len] == ',' || pos[len] == '\0')
+				return pos + len;
+		}
+		pos = strchr(pos, ',');
+		if (pos)
+			pos++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Byte run scanning used to skip padding and detect blank areas. Word
+ * at a time loop is the portable fallback, vector kernels are selected
+ * at startup by bspan_dispatch().
+ */
+typedef size_t (*bspan_kernel_t)(const unsigned char *buf, size_t len, unsigned char c);
+
+static size_t bspan_word(const unsigned char *buf, size_t len, unsigned char c)
+{
+	uint64_t pat = 0x0101010101010101ull * c, val;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&val, buf + i, sizeof(val));
+		if (val != pat)
+			break;
+	}
+
+	while (i < len && buf[i] == c)
+		i++;
+
+	return i;
+}
+
+static bspan_kernel_t bspan_kernel = bspan_word;
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+#define HAVE_BSPAN_AVX2
+
+static size_t bspan_sse2(const unsigned char *buf, size_t len, unsigned char c)
+{
+	__m128i pat = _mm_set1_epi8(c);
+	unsigned int mask;
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i *)(buf + i)), pat));
+		if (mask != 0xFFFF)
+			return i + __builtin_ctz(~mask);
+	}
+
+	return i + bspan_word(buf + i, len - i, c);
+}
+
+__attribute__((target("avx2")))
+static size_t bspan_avx2(const unsigned char *buf, size_t len, unsigned char c)
+{
+	__m256i pat = _mm256_set1_epi8(c);
+	unsigned int mask;
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+				_mm256_loadu_si256((const __m256i *)(buf + i)), pat));
+		if (mask != 0xFFFFFFFF)
+			return i + __builtin_ctz(~mask);
+	}
+
+	return i + bspan_sse2(buf + i, len - i, c);
+}
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+
+#define HAVE_BSPAN_NEON
+
+static size_t bspan_neon(const unsigned char *buf, size_t len, unsigned char c)
+{
+	uint8x16_t pat = vdupq_n_u8(c);
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		if (vminvq_u8(vceqq_u8(vld1q_u8(buf + i), pat)) != 0xFF)
+			break;
+	}
+
+	return i + bspan_word(buf + i, len - i, c);
+}
+#endif
+
+static void __attribute__((constructor)) bspan_dispatch(void)
+{
+#ifdef HAVE_BSPAN_AVX2
+	bspan_kernel = bspan_sse2;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		bspan_kernel = bspan_avx2;
+#endif
+#ifdef HAVE_BSPAN_NEON
+	bspan_kernel = bspan_neon;
+#endif
+}
+
+/* Length of the leading run of bytes equal to c */
+size_t bspan_byte(const void *data, size_t size, unsigned char c)
+{
+	return bspan_kernel(data, size, c);
+}
+
 int bempty_data(void *data, size_t size)
 {
-	unsigned char *ptr = data;
+	return bspan_kernel(data, size, 0xFF) == size;
+}
 
-	while (size > 0 && *ptr == 0xFF) {
-		ptr++;
-		size--;
+/* Copies only bytes that differ, returns number of bytes written */
+size_t bcopy_diff(void *dst, const void *src, size_t size)
+{
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	size_t i = 0, n, written = 0;
+
+	while (i < size) {
+		if (d[i] == s[i]) {
+			i++;
+			continue;
+		}
+		for (n = i + 1; n < size && d[n] != s[n]; n++)
+			;
+		memcpy(d + i, s + i, n - i);
+		written += n - i;
+		i = n;
 	}
-	return size == 0;
+
+	return written;
 }
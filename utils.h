@@ -12,6 +12,10 @@ ssize_t aparse_mac_address(void **data_out, void *data_in, size_t size_in);
 ssize_t aformat_mac_address(void **data_out, void *data_in, size_t size_in);
 
 char *bcopy_text(char *src, size_t len);
+size_t bspan_byte(const void *data, size_t size, unsigned char c);
 int bempty_data(void *data, size_t size);
+size_t bcopy_diff(void *dst, const void *src, size_t size);
+
+const char *sopt_find(const char *opts, const char *name);
 
 #endif /* __STORAGE_UTILS_H */